@@ -6,22 +6,128 @@
 // 	 Light sensor powered by RA4, analog output connected to RB4/AN8
 //   LED connected between RB0(cathode) and RA0(anode)
 //
-// Flash addresses 0x000-0x1FF protected and used by bootloader
-// Downloaded programs must be offset by 0x200
-// 	Reset vector:     0x200
-//  Interrupt vector: 0x204
+// Flash addresses below BOOT_END protected and used by bootloader
+// (0x200, or 0x100 for COMPACT builds)
+// bootloader.mcp links with --ROM=0-1FF and bootloader_compact.mcp builds
+// COMPACT with --ROM=0-FF, so code that does not fit below the service
+// entries fails to link instead of spilling into application flash
+// Downloaded programs must be offset by BOOT_END
+// 	Reset vector:     BOOT_END
+//  Interrupt vector: BOOT_END + 4
+//
+// Data EEPROM address 0xFF is reserved as image-valid marker
 //
 // License: CC BY-NC 2.0
 //
 // senseitg@hotmail.com
 
-#define CLOCK    16000000 // System clock speed (hardcoded in osc_init)
+#define PROFILE         0 // Clock and baudrate profile, see below
 #define LEVEL          42 // Analog high/low trigger level (0-255 = 0-Vdd)
-#define BAUDRATE     9600 // Serial baudrate
+#define FASTBOOT        1 // Start firmware at once unless host wake carrier is seen
+#ifndef COMPACT
+#define COMPACT         0 // Fit in 256 words, leaving out optional commands
+#endif
+
+// Optional commands and framing, left out of COMPACT builds
+#define CMD_SPEAKER   !COMPACT // S: speaker
+#define CMD_BATTERY   !COMPACT // B: battery voltage
+#define CMD_LINK      !COMPACT // L, T: link settings and link test
+#define CMD_ROWS      !COMPACT // F, C: row fill and row copy
+#define CMD_EEPROM    !COMPACT // E, D: data EEPROM
+#define FRAMING_V2    !COMPACT // v2 framed commands with CRC
+
+// Protected bootloader area, applications start at BOOT_END
+#if COMPACT
+#define BOOT_END    0x100
+#else
+#define BOOT_END    0x200
+#endif
+
+// End of flash, rows past it would wrap around onto the bootloader
+#if defined(_16F1826) || defined(_16LF1826)
+#define FLASH_END   0x800
+#else
+#define FLASH_END   0x1000
+#endif
 
 #include <htc.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "bootsvc.h"
+
+// Clock and baudrate profiles
+#if PROFILE == 0
+#define CLOCK    16000000 // 16MHz HF, PLL off
+#define BAUDRATE     9600
+#elif PROFILE == 1
+#define CLOCK    32000000 // 8MHz HF, PLL on
+#define BAUDRATE    19200
+#else
+#error Unknown PROFILE
+#endif
+
+#if CLOCK == 16000000
+#define OSCCON_INIT 0b01111010 // Set PLL off, 16MHz HF, internal
+#elif CLOCK == 32000000
+#define OSCCON_INIT 0b11110000 // Set PLL on, 8MHz HF, clock from config (internal)
+#else
+#error Unsupported CLOCK
+#endif
+
+// Bit timing
+// All figures are in instruction cycles (CLOCK / 4), delay() runs 10 cycles/tick
+// Overheads are cycles spent outside delay() per bit, the A/D conversion in the
+// receive loop takes 11.5 TAD = 92 cycles at Fosc/32 regardless of clock, plus
+// the calls through adc_sample() into svc_sample()
+#define BIT_X10(b)    (CLOCK / 4 * 10 / (b)) // Cycles per bit times 10
+#define TX_OVERHEAD   20
+#define RX_OVERHEAD  134
+#define START_OVERHEAD 24
+#define ADC_CYCLES    92 // A/D conversion
+#define POLL_CYCLES  134 // Main loop pass while waiting for start-bit, conversion included
+#define TOLERANCE     20 // Max bit timing error, per mille
+
+// A start-bit is seen ADC_CYCLES after the sample that caught it, which is
+// taken 0 to POLL_CYCLES after the edge - plan for the average
+#define START_LATENCY (ADC_CYCLES + POLL_CYCLES / 2)
+
+// Delay ticks, rounded to nearest
+#define TX_TICKS_AT(b)    ((BIT_X10(b) - TX_OVERHEAD * 10 + 50) / 100)
+#define RX_TICKS_AT(b)    ((BIT_X10(b) - RX_OVERHEAD * 10 + 50) / 100)
+// First sample in the middle of bit 0, 1.5 bit times after start-bit edge
+#define START_TICKS_AT(b) ((BIT_X10(b) * 15 / 10 - (START_OVERHEAD + START_LATENCY) * 10 + 50) / 100)
+
+// Resulting bit timing error, per mille
+#define TX_ERROR_AT(b) ((TX_TICKS_AT(b) * 100 + TX_OVERHEAD * 10 - BIT_X10(b)) * 1000 / BIT_X10(b))
+#define RX_ERROR_AT(b) ((RX_TICKS_AT(b) * 100 + RX_OVERHEAD * 10 - BIT_X10(b)) * 1000 / BIT_X10(b))
+
+// Start-bit found quickly enough, polling jitter at most 1/3 bit keeps the
+// first sample within 1/6 bit of the middle of bit 0
+#define POLL_OK(b) (POLL_CYCLES * 10 * 3 <= BIT_X10(b))
+
+// Baudrate usable at CLOCK
+#define RATE_OK(b) (RX_TICKS_AT(b) >= 1 && START_TICKS_AT(b) >= 1 && POLL_OK(b) && \
+                    TX_ERROR_AT(b) <= TOLERANCE && TX_ERROR_AT(b) >= -TOLERANCE && \
+                    RX_ERROR_AT(b) <= TOLERANCE && RX_ERROR_AT(b) >= -TOLERANCE)
+
+#define TX_TICKS    TX_TICKS_AT(BAUDRATE)
+#define RX_TICKS    RX_TICKS_AT(BAUDRATE)
+#define START_TICKS START_TICKS_AT(BAUDRATE)
+#define TX_ERROR    TX_ERROR_AT(BAUDRATE)
+#define RX_ERROR    RX_ERROR_AT(BAUDRATE)
+
+#if RX_TICKS < 1 || START_TICKS < 1
+#error Receive loop does not fit in one bit time, lower BAUDRATE or raise CLOCK
+#endif
+#if !POLL_OK(BAUDRATE)
+#error Start-bit polling too slow for BAUDRATE, lower BAUDRATE or raise CLOCK
+#endif
+#if TX_ERROR > TOLERANCE || TX_ERROR < -TOLERANCE
+#error Transmit bit timing error exceeds TOLERANCE
+#endif
+#if RX_ERROR > TOLERANCE || RX_ERROR < -TOLERANCE
+#error Receive bit timing error exceeds TOLERANCE
+#endif
 
 // Original system pin connections
 // RA0 LED col 0             RB0 LED row 0
@@ -34,12 +140,25 @@
 // RA7 Speaker +             RB7 Tuning fork (T1OSO)
 
 __CONFIG(0x0FA4);
+#if COMPACT
+// WRT off - no hardware write protection ends at 0x0FF, so the bootloader
+// relies on the BOOT_END check in svc_flash
+__CONFIG(0x3EFF);
+#else
+// WRT protects 0x000-0x1FF
 __CONFIG(0x3EFE);
+#endif
 
 interrupt redirect_interrupt(void) {
+#if COMPACT
+#asm
+	ljmp 0x104
+#endasm
+#else
 #asm
 	ljmp 0x204
 #endasm
+#endif
 }
 
 void launch_firmware(void) {
@@ -51,20 +170,20 @@ void launch_firmware(void) {
 	PORTB  = 0b00000000;
 	ANSELA = 0b11111111;
 	ANSELB = 0b11111111;
+#if COMPACT
+#asm
+	ljmp 0x100
+#endasm
+#else
 #asm
 	ljmp 0x200
 #endasm
-}
-
-// Run time is exactly 10 cpu cycles/tick (not including call)
-void delay(uint16_t ticks) {
-	asm("nop");
-	while(--ticks);
+#endif
 }
 
 // Initialize oscillator
 void osc_init() {
-	OSCCON = 0b01111010; // Set PLL off, 16MHz HF, internal
+	OSCCON = OSCCON_INIT;
 }
 
 // Initialize A/D-converter
@@ -90,42 +209,249 @@ void init() {
 	adc_init();
 }
 
-// Sample analog input
-bool adc_sample() {
-	ADGO = 1;
-	while(ADGO);
-	return ADRESH > LEVEL;
+#if CMD_LINK
+// Link settings, changed at run time by L command
+uint8_t level       = LEVEL;
+uint8_t tx_ticks    = TX_TICKS;
+uint8_t rx_ticks    = RX_TICKS;
+uint8_t start_ticks = START_TICKS;
+
+// Rates selectable by L command, left out (0) where CLOCK can not keep up
+#define RATE(b) { RATE_OK(b) ? TX_TICKS_AT(b) : 0, RATE_OK(b) ? RX_TICKS_AT(b) : 0, \
+                  RATE_OK(b) ? START_TICKS_AT(b) : 0 }
+const uint8_t rates[4][3] = { RATE(9600), RATE(19200), RATE(38400), RATE(57600) };
+// Main loop iterations without commands before an L setting is dropped (~2 secs)
+#define LINK_REVERT (CLOCK / 320)
+#define LINK_DEFAULT (BAUDRATE == 9600 ? 0 : BAUDRATE == 19200 ? 1 : BAUDRATE == 38400 ? 2 : 3)
+
+// Apply link settings
+void link(uint8_t rate, uint8_t new_level) {
+	tx_ticks    = rates[rate][0];
+	rx_ticks    = rates[rate][1];
+	start_ticks = rates[rate][2];
+	level       = new_level;
 }
+#else
+// Link settings, fixed
+#define level       LEVEL
+#define tx_ticks    TX_TICKS
+#define rx_ticks    RX_TICKS
+#define start_ticks START_TICKS
+#endif
 
 // NAK(negative acknowledge), ACK(acknowledge) ASCII values
 #define NAK 0x15
 #define ACK 0x06
 
-// Transmit single byte
-void tx(uint8_t tx_byte) {
-	uint8_t bit_count = 8;	
-	PORTA &= 0b11111110;
-	while(bit_count--) {	
-		delay(100 * (CLOCK / 4000) / BAUDRATE - 2);
-		if(tx_byte & 1) PORTA |= 0b00000001;
-		else            PORTA &= 0b11111110;
-		tx_byte >>= 1;
+// Start of v2 frame
+#define SYNC 0xA5
+
+// Protocol version reported by I command (3 = F and C commands, 4 = P command,
+// 5 = Q command)
+#define PROTOCOL 5
+
+// Optional commands present, reported by P command
+#define FEATURES ((CMD_ROWS ? 0x01 : 0) | (CMD_LINK ? 0x02 : 0) | (CMD_EEPROM ? 0x04 : 0) | \
+                  (CMD_SPEAKER ? 0x08 : 0) | (CMD_BATTERY ? 0x10 : 0))
+
+#if FRAMING_V2
+// CRC-8, polynomial 0x07
+uint8_t crc8(uint8_t crc, uint8_t data) {
+	uint8_t n = 8;
+	crc ^= data;
+	while(n--) {
+		if(crc & 0x80) crc = (crc << 1) ^ 0x07;
+		else           crc <<= 1;
 	}
-	delay(100 * (CLOCK / 4000) / BAUDRATE - 1);
-	PORTA |= 0b00000001;
-	delay(100 * (CLOCK / 4000) / BAUDRATE - 1);
+	return crc;
 }
 
-// Command buffer
-persistent uint8_t command[66];
+// CRC of transmitted bytes, for v2 responses
+uint8_t tx_crc;
+#endif
 
 // Convenience macros
 #define FLASH_WR EECON2 = 0x55; EECON2 = 0xAA; WR = 1; asm("nop"); asm("nop");
 #define FLASH_RD                               RD = 1; asm("nop"); asm("nop");
 
+// Services, also used by applications through bootsvc.h
+// These run in application context, so they must only use service registers
+
+// Run time is exactly 10 cpu cycles/tick (not including call)
+void svc_delay(void) {
+	asm("nop");
+	while(--svc_ticks);
+}
+
+// Transmit svc_data, svc_bit delay ticks per bit
+void svc_tx(void) {
+	svc_count = 8;
+	PORTA &= 0b11111110;
+	while(svc_count--) {
+		svc_ticks = svc_bit;
+		svc_delay();
+		if(svc_data & 1) PORTA |= 0b00000001;
+		else             PORTA &= 0b11111110;
+		svc_data >>= 1;
+	}
+	svc_ticks = svc_bit + 1;
+	svc_delay();
+	PORTA |= 0b00000001;
+	svc_ticks = svc_bit + 1;
+	svc_delay();
+}
+
+// Sample analog input, result in svc_data
+void svc_sample(void) {
+	ADGO = 1;
+	while(ADGO);
+	svc_data = ADRESH;
+}
+
+// Erase and write flash row at svc_ticks, 32 words read from FSR1
+void svc_flash(void) {
+	if(svc_ticks < BOOT_END || svc_ticks >= FLASH_END) return; // Protect bootloader
+	svc_data = INTCON;     // No interrupts during unlock sequence
+	GIE    = 0;
+	// Enable writes
+	WREN   = 1;
+	// Erase flash page
+	EEADRL = svc_ticks;    // Load address
+	EEADRH = svc_ticks >> 8;
+	CFGS   = 0;            // Target flash
+	EEPGD  = 1;
+	FREE   = 1;            // Specify "erase" operation
+	FLASH_WR;              // Execute!
+	while(FREE);		   // Wait for finish (not really required?)
+	// Load write latches
+	for(svc_count = 0; svc_count < 32; svc_count++) {
+		EEDATH = INDF1;    // Load data
+		if(!++FSR1L) FSR1H++;
+		EEDATL = INDF1;
+		if(!++FSR1L) FSR1H++;
+		LWLO = ((svc_count & 3) != 3); // Specify "load write latch" / actual "write"
+		FLASH_WR;          // Execute
+		EEADRL++;          // Increase address
+	}
+	// Disable writes
+	WREN = 0;
+	if(svc_data & 0x80) GIE = 1;
+}
+
+// Service entry points at fixed addresses
+void svc_delay_entry(void)  @ SVC_DELAY  { svc_delay(); }
+void svc_tx_entry(void)     @ SVC_TX     { svc_tx(); }
+void svc_sample_entry(void) @ SVC_SAMPLE { svc_sample(); }
+void svc_flash_entry(void)  @ SVC_FLASH  { svc_flash(); }
+
+// Bootloader uses the services too, rather than keeping copies of them
+#define delay(ticks) do { svc_ticks = (ticks); svc_delay(); } while(0)
+
+// Sample analog input
+bool adc_sample() {
+	svc_sample();
+	return svc_data > level;
+}
+
+// Fast boot carrier detection: samples taken (~125 cycles each) and level changes required
+#define CARRIER_SAMPLES 200
+#define CARRIER_EDGES    16
+
+// Look for host wake carrier, a stream of 0x55 bytes toggling the input every bit
+bool carrier() {
+	uint8_t n = CARRIER_SAMPLES;
+	uint8_t edges = 0;
+	bool high = adc_sample();
+	while(--n) {
+		if(adc_sample() != high) {
+			high = !high;
+			edges++;
+		}
+	}
+	return edges >= CARRIER_EDGES;
+}
+
+// Transmit single byte
+void tx(uint8_t tx_byte) {
+#if FRAMING_V2
+	tx_crc = crc8(tx_crc, tx_byte);
+#endif
+	svc_data = tx_byte;
+	svc_bit  = tx_ticks;
+	svc_tx();
+}
+
+// Data EEPROM bytes carried by one E command
+#define EEPROM_BLOCK 16
+
+#if CMD_LINK
+// Pattern bytes echoed by one T command
+#define LINK_TEST 16
+
+// Framing errors seen since last T command
+uint16_t framing_errors;
+
+// L command accepted, new link settings apply once the response is sent
+bool link_pending;
+#endif
+
+// Command buffer (W: id, page, 64 data, checksum, v2 CRC)
+persistent uint8_t command[68];
+
+// Data EEPROM address of image-valid marker, 0x00 while a download is in progress
+#define MARKER 0xFF
+
+// Read data EEPROM
+uint8_t eeprom_read(uint8_t addr) {
+	EEADRL = addr;             // Load address
+	CFGS   = 0;                // Target data EEPROM
+	EEPGD  = 0;
+	FLASH_RD;                  // Execute
+	return EEDATL;
+}
+
+// Write data EEPROM, unchanged bytes are skipped to save time and wear
+void eeprom_write(uint8_t addr, uint8_t data) {
+	if(eeprom_read(addr) != data) {
+		EEDATL = data;         // Load data
+		WREN   = 1;            // Enable writes
+		FLASH_WR;              // Execute!
+		while(WR);             // Wait for finish (~4ms)
+		WREN   = 0;            // Disable writes
+	}
+}
+
+// Read flash page into command buffer, returns checksum over page and data
+uint8_t row_read(uint8_t page) {
+	uint8_t n;
+	uint8_t csum = page;
+	uint16_t addr = page << 5;
+	EEADRL = addr;             // Load address
+	EEADRH = addr >> 8;
+	CFGS   = 0;                // Target flash
+	EEPGD  = 1;
+	for(n = 2; n < 66; ) {
+		FLASH_RD;              // Execute
+		command[n++] = EEDATH; csum += EEDATH;
+		command[n++] = EEDATL; csum += EEDATL;
+		EEADRL++;              // Increment address
+	}
+	return csum;
+}
+
+// Write flash page from command buffer
+void row_write(uint8_t page) {
+	// Image is incomplete until X
+	eeprom_write(MARKER, 0x00);
+	// Erase and write flash page
+	svc_ticks = page << 5;
+	FSR1L = (uint16_t)&command[2];
+	FSR1H = (uint16_t)&command[2] >> 8;
+	svc_flash();
+}
+
 // Command executer
 void execute() {
-	uint16_t addr;
 	uint8_t n;
 	uint8_t csum;
 	if(command[0] == 'W') {
@@ -138,27 +464,7 @@ void execute() {
 			tx(NAK);
 			tx(csum);
 		} else {
-			addr = command[1] << 5;
-			// Enable writes
-			WREN   = 1;
-			// Erase flash page
-			EEADRL = addr;         // Load address
-			EEADRH = addr >> 8;
-			CFGS   = 0;            // Target flash
-			EEPGD  = 1;
-			FREE   = 1;            // Specify "erase" operation
-			FLASH_WR;              // Execute!
-			while(FREE);		   // Wait for finish (not really required?)
-			// Load write latches
-			for(n = 2; n < 66; ) {
-				EEDATH = command[n++]; // Load data
-				EEDATL = command[n++];
-				LWLO = ((n & 7) != 2); // Specify "load write latch" / actual "write"
-                FLASH_WR;              // Execute
-				EEADRL++;              // Increase address
-			}
-			// Disable writes
-			WREN = 0;
+			row_write(command[1]);
 			// Respond with ACK=success
 			// Note: while unlikely, it is possible for flash writes to fail and
 			//       it could be considered good practice to verify the data,
@@ -168,126 +474,371 @@ void execute() {
 	} else if(command[0] == 'R') {
 		// R(ead) - respond with ACK=successful
 		tx(ACK);
-		addr = command[1] << 5;
+		// Read data from flash, calculate checksum
+		csum = row_read(command[1]);
+		// Send data and checksum
+		for(n = 2; n < 66; n++) {
+			tx(command[n]);
+		}
+		tx(csum);
+#if CMD_ROWS
+	} else if(command[0] == 'F' || command[0] == 'C') {
+		// F(ill) page with one word, or C(opy) it from another page
+		// Verify checksum (F: page, word, checksum / C: page, source page, checksum)
+		csum = command[1] + command[2];
+		n = 3;
+		if(command[0] == 'F') csum += command[n++];
+		if(csum != command[n]) {
+			tx(NAK);
+			tx(csum);
+		} else {
+			// Build page in command buffer
+			if(command[0] == 'F') {
+				for(n = 4; n < 66; n++) {
+					command[n] = command[n - 2];
+				}
+			} else {
+				row_read(command[2]);
+			}
+			row_write(command[1]);
+			// Respond with ACK=success and checksum of page as R would,
+			// so host can verify without reading it back
+			tx(ACK);
+			tx(row_read(command[1]));
+		}
+	} else if(command[0] == 'Q') {
+		// Q(uery) - respond with ACK=success and checksum of each page as R would,
+		// so host can find rows to copy (page, count)
+		tx(ACK);
+		for(n = command[2]; n; n--) {
+			tx(row_read(command[1]++));
+		}
+#endif
+#if CMD_EEPROM
+	} else if(command[0] == 'E') {
+		// Verify checksum
+		csum = 0;
+		for(n = 1; n < EEPROM_BLOCK + 3; n++) {
+			csum += command[n];
+		}
+		// Marker is reserved for the bootloader
+		if(csum != command[n] || command[2] > EEPROM_BLOCK || command[1] + command[2] > MARKER) {
+			tx(NAK);
+			tx(csum);
+		} else {
+			for(n = 0; n < command[2]; n++) {
+				eeprom_write(command[1] + n, command[n + 3]);
+			}
+			// Respond with ACK=success
+			tx(ACK);
+		}
+	} else if(command[0] == 'D') {
+		// D(ata EEPROM read) - respond with ACK=successful
+		tx(ACK);
 		csum = command[1];
-		// Read data from flash
-		EEADRL = addr;             // Load address
-		EEADRH = addr >> 8;
-		CFGS   = 0;                // Target flash
-		EEPGD  = 1;
-		for(n = 0; n < 32; n++) {
-			FLASH_RD;                  // Execute
-			// Load and send data, calculate checksum
-			tx(EEDATH); csum += EEDATH;
-			tx(EEDATL); csum += EEDATL;
-			EEADRL++;                  // Increment address
+		// Read data from EEPROM, send data, calculate checksum
+		for(n = 0; n < command[2]; n++) {
+			tx(eeprom_read(command[1] + n));
+			csum += EEDATL;
 		}
 		// Send checksum
 		tx(csum);
+#endif
+#if CMD_BATTERY
 	} else if(command[0] == 'B') {
 		// Respond with ACK=success
 		tx(ACK);
 		FVRCON = 0b10000001; // Enable FVR = 1.024V
 		ADCON0 = 0b01111101; // Enable ADC @ FVR
 		while(!FVRRDY);		 // Wait for FVR to stabilize
-		delay(1000);	     // Delay some more (yup, it wobbled)
+		delay(CLOCK / 16000); // Delay some more (yup, it wobbled)
 		ADGO = 1;			 // Sample FVR
 		while(ADGO);		 // Wait for sampling
 		tx(ADRESH);			 // Send results
 		tx(ADRESL);
 		FVRCON = 0b00000000; // Disable FVR
 		adc_init();			 // Reset ADC
+#endif
 	} else if(command[0] == 'X') {
 		// Respond with ACK=success
 		tx(ACK);
+		// Mark image valid
+		eeprom_write(MARKER, 0xFF);
 		launch_firmware();
+#if CMD_LINK
+	} else if(command[0] == 'L') {
+		// L(ink) - rate index, level (0 = default)
+		if(command[1] < 4 && rates[command[1]][0]) {
+			tx(ACK);
+			link_pending = true;
+		} else {
+			tx(NAK);
+		}
+	} else if(command[0] == 'T') {
+		// T(est) - echo pattern, respond with framing error count
+		tx(ACK);
+		for(n = 1; n < LINK_TEST + 1; n++) {
+			tx(command[n]);
+		}
+		tx(framing_errors >> 8);
+		tx(framing_errors);
+		framing_errors = 0;
+#endif
+	} else if(command[0] == 'I') {
+		// Respond with ACK=success, protocol version
+		tx(ACK);
+		tx(PROTOCOL);
+	} else if(command[0] == 'P') {
+		// P(roperties) - respond with ACK=success, first application page, optional commands
+		tx(ACK);
+		tx(BOOT_END >> 5);
+		tx(FEATURES);
+#if CMD_SPEAKER
 	} else if(command[0] == 'S') {
 		tx(ACK);
 		TRISA = 0b00101110;
 		for(uint16_t n = 0; n < command[2]<<8; n++) {
-			delay(command[1]);
+			delay(command[1] * (CLOCK / 16000000));
 			PORTA = 0b10010001;
-			delay(command[1]);
+			delay(command[1] * (CLOCK / 16000000));
 			PORTA = 0b01010001;
 		}
 		TRISA = 0b11101110;
 		tx(ACK);
+#endif
 	} else {
 		// Unknown command, respond with NAK=unsuccessful
 		tx(NAK);
 	}
 }
 
+// Number of bytes expected for command, including identifier (0 = unknown)
+uint8_t command_length(uint8_t id) {
+	switch(id) {
+		case 'W':
+			// Write flash, needs 1 page, 64 data, 1 checksum
+			return 67;
+		case 'R':
+			// Read flash, needs 1 page
+			return 2;
+#if CMD_ROWS
+		case 'F':
+			// Fill flash, needs 1 page, 1 word, 1 checksum
+			return 5;
+		case 'C':
+			// Copy flash, needs 1 page, 1 source page, 1 checksum
+			return 4;
+		case 'Q':
+			// Query row checksums, needs 1 page, 1 count
+			return 3;
+#endif
+#if CMD_EEPROM
+		case 'E':
+			// Write data EEPROM, needs address, count, data, 1 checksum
+			return EEPROM_BLOCK + 4;
+		case 'D':
+			// Read data EEPROM, needs address, count
+			return 3;
+#endif
+#if CMD_BATTERY
+		case 'B':
+			// Battery voltage readout
+			return 1;
+#endif
+		case 'X':
+			// Execute downloaded program
+			return 1;
+#if CMD_SPEAKER
+		case 'S':
+			// Speaker, expect frequency
+			return 3;
+#endif
+		case 'I':
+			// Bootloader information
+			return 1;
+		case 'P':
+			// Bootloader properties
+			return 1;
+#if CMD_LINK
+		case 'L':
+			// Link settings, needs rate index, level
+			return 3;
+		case 'T':
+			// Link test, needs pattern
+			return LINK_TEST + 1;
+#endif
+	}
+	return 0;
+}
+
+#if FRAMING_V2
+// Passes of about one bit time the line must stay idle before a damaged
+// v2 frame is answered, any bytes arriving meanwhile are discarded
+#define DISCARD_PASSES 30
+
+// Check v2 frame, payload length must match command
+// Frame CRC covers command, payload length, payload and itself (result is 0)
+bool frame_valid(uint8_t frame_length) {
+	uint8_t crc;
+	uint8_t n;
+	crc = crc8(crc8(0, command[0]), frame_length);
+	for(n = 1; n < frame_length + 2; n++) {
+		crc = crc8(crc, command[n]);
+	}
+	return !crc && command_length(command[0]) == frame_length + 1;
+}
+
+// Answer v2 frame in one go: SYNC, response, CRC
+void execute_frame(bool valid) {
+	tx(SYNC);
+	tx_crc = 0;
+	if(valid) execute();
+	else      tx(NAK);
+	tx(tx_crc);
+}
+#endif
+
 void main() {
 	init();
 	uint8_t rx_byte;
 	uint8_t length = 0;
 	uint8_t bit_count;
 	uint8_t index;
-	uint24_t countdown = 100000; // a couple of secs
+#if FRAMING_V2
+	uint8_t frame = 0;           // 0 = v1, 1 = v2 header, 2 = v2 payload
+	uint8_t frame_length;
+	uint8_t discard = 0;         // damaged v2 frame, passes until line counts as idle
+#endif
+	uint24_t countdown = CLOCK / 160; // a couple of secs
+#if CMD_LINK
+	uint24_t revert = 0;
+#endif
 	bool wait_mark = true;
+	bool ready;
+#if FASTBOOT
+	// No host waking us up, start firmware unless the last download was not completed
+	// Wake carrier bytes are then answered as unknown commands, telling the host we are up
+	if(!carrier()) if(eeprom_read(MARKER)) launch_firmware();
+#endif
 	while(1) {
 		if(countdown) {
-			if(--countdown == 0) launch_firmware();
+			// Stay in bootloader if the last download was not completed
+			if(--countdown == 0) if(eeprom_read(MARKER)) launch_firmware();
 		}
+#if CMD_LINK
+		if(revert) {
+			// No commands at new link settings, host lost us - restore defaults
+			// and drop whatever was half received at the wrong setting
+			if(--revert == 0) {
+				link(LINK_DEFAULT, LEVEL);
+				length    = 0;
+#if FRAMING_V2
+				frame     = 0;
+				discard   = 0;
+#endif
+				wait_mark = true;
+			}
+		}
+#endif
 		if(wait_mark) {
 			// Wait for mark;
 			if(adc_sample()) wait_mark = false;
+#if FRAMING_V2
+		} else if(discard) {
+			// Rest of a damaged frame must not run as v1 commands, so wait
+			// for the line to go idle, then NAK the frame
+			if(!adc_sample()) {
+				discard = DISCARD_PASSES;
+			} else {
+				delay(rx_ticks);
+				if(--discard == 0) {
+					execute_frame(false);
+					length = 0;
+				}
+			}
+#endif
 		} else {
 			// Wait for start-bit
 			if(!adc_sample()) {
-				// Got start-bit, delay 1.3 bit times (too much latency for 1.5)
-				delay(130 * (CLOCK / 4000) / BAUDRATE - 2);
+				// Got start-bit, delay until middle of bit 0
+				delay(start_ticks);
 				// Sample 8 bits
 				bit_count = 8;
 				while(bit_count--) {
 					rx_byte = (rx_byte >> 1) | (adc_sample() ? 0x80 : 0x00);
-					delay(100 * (CLOCK / 4000) / BAUDRATE - 13);
+					delay(rx_ticks);
 				}
 				// Check stop bit
 				if(adc_sample()) {
+					ready = false;
 					if(length) {
 						// Expecting data
 						command[index++] = rx_byte;
 						if(!--length) {
-							execute();     // execute command
-							countdown = 0; // disable countdown
+							ready = true;
+#if FRAMING_V2
+							if(frame == 1) {
+								// Got v2 command and payload length, expect payload and CRC
+								ready = false;
+								frame = 2;
+								frame_length = command[1];
+								if(frame_length <= sizeof(command) - 2) {
+									length = frame_length + 1;
+									index = 1;
+								} else {
+									// Too long for any command
+									discard = DISCARD_PASSES;
+								}
+							}
+#endif
 						}
+#if FRAMING_V2
+					} else if(rx_byte == SYNC) {
+						// Start of v2 frame, expect command and payload length
+						frame = 1;
+						index = 0;
+						length = 2;
+#endif
 					} else {
 						// Expecting command identifier
+#if FRAMING_V2
+						frame = 0;
+#endif
 						command[0] = rx_byte;
 						index = 1;
-						switch(rx_byte) {
-							case 'W':
-								// Write flash, needs 1 page, 64 data, 1 checksum
-								length = 67;
-								break;
-							case 'R':
-								// Read flash, needs 1 page
-								length = 2;
-								break;
-							case 'B':
-								// Battery voltage readout
-								length = 1;
-								break;
-							case 'X':
-								// Execute downloaded program
-								length = 1;
-								break;
-							case 'S':
-								// Speaker, expect frequency
-								length = 3;
-								break;
-						}
+						length = command_length(rx_byte);
 						// Send number of bytes expected
 						tx(length);
-						if(length) if(!--length) {
-							execute();
-							countdown = 0;
+						if(length) if(!--length) ready = true;
+					}
+#if FRAMING_V2
+					if(ready && frame && !frame_valid(frame_length)) {
+						ready = false;
+						discard = DISCARD_PASSES;
+					}
+#endif
+					if(ready) {
+#if FRAMING_V2
+						if(frame) execute_frame(true);
+						else      execute(); // execute command
+#else
+						execute();           // execute command
+#endif
+						countdown = 0;       // disable countdown
+#if CMD_LINK
+						if(revert) revert = LINK_REVERT;
+						if(link_pending) {
+							link_pending = false;
+							link(command[1], command[2] ? command[2] : LEVEL);
+							revert = LINK_REVERT;
 						}
+#endif
 					}
 				} else {
 					// Framing error, wait for mark
+#if CMD_LINK
+					framing_errors++;
+#endif
 					wait_mark = true;
 				}
 			}
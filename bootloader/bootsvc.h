@@ -0,0 +1,61 @@
+// Bootloader services for applications
+//
+// The bootloader keeps some of its routines callable at fixed addresses,
+// so applications can use them instead of carrying their own copies.
+// Arguments and results are passed in service registers, absolute
+// variables at the top of common RAM which this header reserves.
+//
+// Services do not preserve W, STATUS, BSR or FSR1.
+//
+// Applications for a COMPACT bootloader define BOOT_END 0x100 before
+// including this header.
+//
+// Usage:
+//   #include "../bootloader/bootsvc.h"
+//   boot_tx('A', BOOT_BIT_TICKS(16000000, 9600));
+
+#ifndef BOOTSVC_H
+#define BOOTSVC_H
+
+#include <stdint.h>
+
+// End of protected bootloader area
+#ifndef BOOT_END
+#define BOOT_END 0x200
+#endif
+
+// Service entry points, 4 words each at the top of the protected area
+#define SVC_DELAY  (BOOT_END - 0x10) // Wait svc_ticks * 10 cycles (svc_ticks > 0)
+#define SVC_TX     (BOOT_END - 0x0C) // Send svc_data on LED, svc_bit delay ticks per bit
+#define SVC_SAMPLE (BOOT_END - 0x08) // A/D conversion, ADRESH returned in svc_data
+#define SVC_FLASH  (BOOT_END - 0x04) // Erase and write row at word address svc_ticks,
+                                     // 64 bytes (high byte first) read from FSR1
+
+// Service registers, static like the device registers in htc.h so every
+// module including this header can use them
+static volatile uint8_t  svc_bit   @ 0x7B;
+static volatile uint8_t  svc_data  @ 0x7C;
+static volatile uint8_t  svc_count @ 0x7D;
+static volatile uint16_t svc_ticks @ 0x7E;
+
+// Delay ticks per bit for boot_tx, same as bootloader at given clock and baudrate
+#define BOOT_BIT_TICKS(clock, baud) (((clock) / 4 * 10 / (baud) - 200 + 50) / 100)
+
+#define SVC_CALL_(addr) asm("fcall " #addr); asm("pagesel $")
+#define SVC_CALL(addr)  SVC_CALL_(addr)
+
+// Wait ticks * 10 cycles
+#define boot_delay(ticks) do { svc_ticks = (ticks); SVC_CALL(SVC_DELAY); } while(0)
+
+// Send byte on LED, RA0 must be an output and idle high
+#define boot_tx(byte, bit) do { svc_data = (byte); svc_bit = (bit); SVC_CALL(SVC_TX); } while(0)
+
+// A/D conversion on channel set up by application, result in svc_data
+#define boot_sample() do { SVC_CALL(SVC_SAMPLE); } while(0)
+
+// Erase and write 32 word flash row, rows below BOOT_END or past
+// the end of flash are refused
+#define boot_flash(addr, buf) do { svc_ticks = (addr); FSR1L = (uint16_t)(buf); \
+                                   FSR1H = (uint16_t)(buf) >> 8; SVC_CALL(SVC_FLASH); } while(0)
+
+#endif
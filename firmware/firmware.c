@@ -1,14 +1,10 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <htc.h>
+#include "../bootloader/bootsvc.h"
 
-// Run time is exactly 10 cpu cycles/tick (not including call)
-void delay(uint16_t ticks) {
-	asm("nop");
-	while(--ticks);
-}
-
-#define DLY delay(65500);
+// Delay from bootloader services, 10 cpu cycles/tick
+#define DLY boot_delay(65500);
 
 void func(uint8_t val, uint8_t ring) {
   uint8_t rb, ra;
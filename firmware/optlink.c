@@ -0,0 +1,165 @@
+// Optical data channel for applications, see optlink.h
+
+#include <htc.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../bootloader/bootsvc.h"
+#include "optlink.h"
+
+#define NAK 0x15
+#define ACK 0x06
+#define SYNC 0xA5
+
+// Timer2 period in instruction cycles, 4 samples per bit
+// Must leave room for the A/D conversion (92 cycles at Fosc/32) and the interrupt
+#define PERIOD (OPTLINK_CLOCK / 4 / OPTLINK_BAUD / 4)
+#if PERIOD < 200
+#error Sample interrupt does not fit in PERIOD, lower OPTLINK_BAUD or raise OPTLINK_CLOCK
+#elif PERIOD <= 256
+#define T2CON_INIT 0b00000100 // Timer2 on, prescaler 1:1
+#define PR2_INIT   (PERIOD - 1)
+#elif PERIOD <= 1024
+#define T2CON_INIT 0b00000101 // Timer2 on, prescaler 1:4
+#define PR2_INIT   (PERIOD / 4 - 1)
+#elif PERIOD <= 4096
+#define T2CON_INIT 0b00000110 // Timer2 on, prescaler 1:16
+#define PR2_INIT   (PERIOD / 16 - 1)
+#else
+#error OPTLINK_BAUD too low for Timer2
+#endif
+
+// Delay ticks per bit for answers through the bootloader tx service
+#define TX_BIT BOOT_BIT_TICKS(OPTLINK_CLOCK, OPTLINK_BAUD)
+#if TX_BIT > 255
+#error Answer bit time does not fit svc_bit, raise OPTLINK_BAUD
+#endif
+
+uint8_t optlink_type;
+uint8_t optlink_length;
+uint8_t optlink_data[OPTLINK_MAX];
+uint8_t optlink_level = OPTLINK_LEVEL;
+
+// Receiver state, owned by interrupt
+static uint8_t rx_tick;  // Samples to next bit, 0 = waiting for start bit
+static uint8_t rx_bits;  // Bits left, including stop bit
+static uint8_t rx_shift;
+static bool rx_mark;     // Idle line seen, start bit may follow
+
+// Frame after SYNC: type, length, payload, CRC
+static uint8_t rx_frame[OPTLINK_MAX + 3];
+static volatile uint8_t rx_index;  // Next frame byte, 0xFF = waiting for SYNC
+static volatile bool rx_complete;  // Frame waiting for optlink_poll
+
+// CRC-8, polynomial 0x07
+static uint8_t crc8(uint8_t crc, uint8_t data) {
+	uint8_t n;
+	crc ^= data;
+	for(n = 0; n < 8; n++) {
+		if(crc & 0x80) crc = (crc << 1) ^ 0x07;
+		else           crc <<= 1;
+	}
+	return crc;
+}
+
+void optlink_init(void) {
+	// Light sensor power and input, as the bootloader sets them up
+	TRISA  &= 0b11101111;
+	PORTA  &= 0b11101111;
+	TRISB  |= 0b00010000;
+	ANSELB |= 0b00010000;
+	ADCON1 = 0b00100000; // Format = left justified, Clock = Fosc/32
+	ADCON0 = 0b00100001; // Enable ADC @ AN8
+	rx_index = 0xFF;
+	rx_complete = false;
+	// Sample timer
+	PR2    = PR2_INIT;
+	TMR2   = 0;
+	T2CON  = T2CON_INIT;
+	TMR2IF = 0;
+	TMR2IE = 1;
+	PEIE   = 1;
+	GIE    = 1;
+	ADGO   = 1;
+}
+
+void optlink_isr(void) {
+	bool sample;
+	if(!TMR2IF) return;
+	TMR2IF = 0;
+	// Result of conversion started last time, start next one
+	sample = ADRESH > optlink_level;
+	ADGO = 1;
+	if(!rx_tick) {
+		// Wait for mark, then start-bit
+		if(sample) {
+			rx_mark = true;
+		} else if(rx_mark) {
+			// First data bit sampled 1.5 bit times after the edge, one of them is conversion lag
+			rx_mark = false;
+			rx_tick = 6;
+			rx_bits = 9;
+		}
+	} else if(!--rx_tick) {
+		if(--rx_bits) {
+			// Data bit, LSB first
+			rx_shift = (rx_shift >> 1) | (sample ? 0x80 : 0x00);
+			rx_tick = 4;
+		} else if(sample) {
+			// Good stop bit, add byte to frame unless the last one is still waiting
+			rx_mark = true;
+			if(!rx_complete) {
+				if(rx_index == 0xFF) {
+					if(rx_shift == SYNC) rx_index = 0;
+				} else {
+					rx_frame[rx_index++] = rx_shift;
+					if(rx_index == 2 && rx_shift > OPTLINK_MAX) {
+						rx_index = 0xFF; // Too long for us
+					} else if(rx_index > 2 && rx_index == rx_frame[1] + 3) {
+						rx_complete = true;
+					}
+				}
+			}
+		} else {
+			// Framing error, drop frame and wait for mark
+			rx_index = 0xFF;
+		}
+	}
+}
+
+bool optlink_poll(void) {
+	uint8_t crc = 0;
+	uint8_t n;
+	uint8_t trisa, trisb, porta, portb;
+	if(!rx_complete) return false;
+	// CRC covers type, length, payload and itself (result is 0)
+	for(n = 0; n < rx_frame[1] + 3; n++) {
+		crc = crc8(crc, rx_frame[n]);
+	}
+	if(!crc) {
+		optlink_type   = rx_frame[0];
+		optlink_length = rx_frame[1];
+		for(n = 0; n < optlink_length; n++) {
+			optlink_data[n] = rx_frame[n + 2];
+		}
+	}
+	// Answer on LED, sampling interrupts would stretch the bits
+	GIE = 0;
+	trisa = TRISA;
+	trisb = TRISB;
+	porta = PORTA;
+	portb = PORTB;
+	TRISA &= 0b11111110;
+	TRISB &= 0b11111110;
+	PORTB &= 0b11111110;
+	PORTA |= 0b00000001;
+	boot_delay(TX_BIT);  // Idle for a bit before start-bit
+	boot_tx(crc ? NAK : ACK, TX_BIT);
+	PORTA = porta;
+	PORTB = portb;
+	TRISA = trisa;
+	TRISB = trisb;
+	rx_index = 0xFF;
+	rx_complete = false;
+	GIE = 1;
+	return !crc;
+}
@@ -0,0 +1,55 @@
+// Optical data channel for applications
+//
+// Receives short framed messages on the light sensor while the application
+// runs, without resetting into the bootloader. Same wiring and A/D sampling
+// as the bootloader, driven by Timer2 interrupts at 4 samples per bit.
+//
+// Frame: SYNC (0xA5), type, length, payload, CRC-8 (polynomial 0x07) over
+// all but SYNC, as sent by "optic --send". Good frames are answered with
+// ACK and bad ones with NAK on the LED, through the bootloader tx service.
+//
+// Usage, with optlink.c added to the application project:
+//   optlink_init();
+//   interrupt isr(void) { optlink_isr(); }
+//   if(optlink_poll()) { use optlink_type, optlink_length, optlink_data }
+//
+// Uses Timer2, A/D converter, RB4/AN8, RA4 (sensor power) and the RA0/RB0 LED.
+
+#ifndef OPTLINK_H
+#define OPTLINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef OPTLINK_CLOCK
+#define OPTLINK_CLOCK 16000000 // Application clock
+#endif
+#ifndef OPTLINK_BAUD
+#define OPTLINK_BAUD      2400 // Baudrate, optic --send -s must match
+#endif
+#ifndef OPTLINK_LEVEL
+#define OPTLINK_LEVEL       42 // Analog high/low trigger level (0-255 = 0-Vdd)
+#endif
+#ifndef OPTLINK_MAX
+#define OPTLINK_MAX         16 // Largest payload accepted
+#endif
+
+// Last good message, kept until optlink_poll returns true again
+extern uint8_t optlink_type;
+extern uint8_t optlink_length;
+extern uint8_t optlink_data[OPTLINK_MAX];
+
+// Analog trigger level, may be changed at run time
+extern uint8_t optlink_level;
+
+// Set up A/D converter and Timer2, enable interrupts
+void optlink_init(void);
+
+// Sample input, call from application interrupt function
+void optlink_isr(void);
+
+// Check for a complete frame, answer it and return true if it is good
+// The LED pins are borrowed for the answer, interrupts are off while it is sent
+bool optlink_poll(void);
+
+#endif
@@ -4,7 +4,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <windows.h>
-#include "serial.h"
+#include "transport.h"
 
 typedef enum {
 	IGNORE_PROTECTED = 1,
@@ -13,11 +13,31 @@ typedef enum {
 	DISPLAY_MAP = 8
 } flags_e;
 
+// Data EEPROM as placed in hex files by the compiler (word 0xF000, low bytes)
+#define EEPROM_HEX 0x1E000
+// Data EEPROM bytes carried by one E command
+#define EEPROM_BLOCK 16
+// Data EEPROM address of image-valid marker, reserved by the bootloader
+#define EEPROM_MARKER 0xFF
+
+// In-application optical data channel, see firmware/optlink.h
+#define SEND_MAX 16     // Largest payload application accepts
+#define SEND_BAUD 2400  // Application baudrate
+
 void help_out(bool full) {
-	printf("Useage: optic firmware.hex -o COMn (-i)\n");
+	printf("Useage: optic [firmware.hex] [--eeprom eeprom.hex] -o COMn (-i)\n");
 	if(full) {
 		printf("firmware.hex   firmware file to download to target\n");
-		printf("-o COMn        communications port to use for download\n");
+		printf("--eeprom file  hex file with data EEPROM contents to write to target\n");
+		printf("-o COMn        communications port to use for download, or\n");
+		printf("   loop        simulated target, or\n");
+		printf("   unix:path   station daemon socket, with optional @head\n");
+		printf("-s baud        baudrate, must match bootloader profile (default 9600)\n");
+		printf("--link b,l     switch to baudrate b and analog level l for this session\n");
+		printf("--link-test    measure bit error rates and recommend a --link setting\n");
+		printf("--trace file   record link traffic to file, see optrace\n");
+		printf("--send hex     send message to running application, first byte is type\n");
+		printf("               (default -s %u, see firmware/optlink.h)\n",SEND_BAUD);
 		printf("-p             ignore data at protected addresses\n");
 		printf("-r             ignore data at out-of-range addresses\n");
 		printf("-b             ignore battery level\n");
@@ -48,82 +68,574 @@ bool crunch(char *record) {
 	return true;
 }
 
+// Load hex file into memory model
+// pgmem holds 0x1000 program words, eemem 0x100 data EEPROM bytes (>0xFF = unused)
+bool load_hex(char *filename,uint16_t *pgmem,uint16_t *eemem,uint8_t flags) {
+	int n;
+	FILE *f=fopen(filename,"r");
+	if(!f) {
+		printf("Failed to open file %s\n",filename);
+		return false;
+	}
+	char record[256];
+	uint32_t lnum=0;
+	bool read_ok=true;
+	size_t llen;
+	uint32_t addr=0x00000000;
+	while(read_ok&&!feof(f)) {
+		lnum++;
+		fgets(record,sizeof(record),f);
+		if(record[strlen(record)-1]==0x0A) record[strlen(record)-1]=0;
+		llen=strlen(record);
+		if(llen) {
+			if(record[0]!=':') {
+				printf("%s:%i record does not start with ':'\n",filename,lnum);
+				read_ok=false;
+			} else if((llen&1)==0) {
+				printf("%s:%i record is of incorrect length\n",filename,lnum);
+				read_ok=false;
+			} else if(!crunch(&record[1])) {
+				printf("%s:%i record contains bad characters\n",filename,lnum);
+				read_ok=false;
+			} else {
+				llen>>=1;
+				if(llen<5) {
+					printf("%s:%i record length below minimum\n",filename,lnum);
+					read_ok=false;
+				} else if(llen!=record[1]+5) {
+					printf("%s:%i record length/byte count field mismatch\n",filename,lnum);
+					read_ok=false;
+				} else {
+					uint8_t count=record[1];
+					addr&=0xFFFF0000;
+					addr|=(((uint8_t)record[2])<<8)|((uint8_t)record[3]);
+					uint8_t type=record[4];
+					uint8_t *p_data=&record[5];
+					uint8_t csum=0;
+					for(n=1;n<5+count;n++) csum+=record[n];
+					csum=(~csum)+1;
+					if(csum!=(uint8_t)record[5+count]) {
+						printf("%s:%i checksum mismatch\n",filename,lnum);
+						read_ok=false;
+					} else {
+						if(type==0x00) {
+							while(count--) {
+								if(addr>=EEPROM_HEX&&addr<EEPROM_HEX+0x200) {
+									// Data EEPROM, high bytes are padding
+									if(!(addr&1)) eemem[(addr-EEPROM_HEX)>>1]=*p_data;
+								} else if(addr>=0x2000) {
+									if(!(flags&IGNORE_OUTOFRANGE)) {
+										printf("%s:%i address out of range\n",filename,lnum);
+										read_ok=false;
+										break;
+									}
+								} else {
+									if(addr&1) {
+										pgmem[addr>>1] = (pgmem[addr>>1] & 0x00FF) | (*p_data) << 8;
+									} else {
+										pgmem[addr>>1] = (pgmem[addr>>1] & 0xFF00) | *p_data;
+									}
+								}
+								p_data++;
+								addr++;
+							}
+						} else if(type==0x01) {
+							if(count) {
+								printf("%s:%i bad byte count for \"end of file\" record\n",filename,lnum);
+								read_ok=false;
+							}
+							break;
+						} else if(type==0x04) {
+							if((addr&0x0000FFFF)!=0x00000000) {
+								printf("%s:%i bad address for \"extended linear address\" record\n",filename,lnum);
+								read_ok=false;
+							} else if(count!=2) {
+								printf("%s:%i incorrect byte count for \"extended linear address\" record\n",filename,lnum);
+								read_ok=false;
+							} else {
+								addr=(((uint8_t)record[5])<<24)|(((uint8_t)record[6])<<16);
+							}
+						} else {
+							printf("%s:%i this record type is not supported\n",filename,lnum);
+							read_ok=false;
+						}
+					}
+				}
+			}
+		}
+	}
+	fclose(f);
+	return read_ok;
+}
+
+// Build W command for one 32 word page: page, 64 data, checksum
+void make_row(uint16_t *pgmem,uint8_t page,uint8_t *pwrite) {
+	int z;
+	uint8_t csum=page;
+	pwrite[0]=page;
+	for(z=0;z<0x20;z++) {
+		pwrite[(z<<1)+1]=pgmem[(page<<5)+z]>>8;
+		csum+=pgmem[(page<<5)+z]>>8;
+		pwrite[(z<<1)+2]=pgmem[(page<<5)+z]&0xFF;
+		csum+=pgmem[(page<<5)+z]&0xFF;
+	}
+	pwrite[65]=csum;
+}
+
+// Plan how to get one page to target, returns command and fills its payload
+// F (fill with one word) and C (copy a page target already holds) cost 5 and 4
+// bytes plus a 2 byte checksum answer, against 67 for W plus 66 to read it back
+// present: pages written this session, known to match pgmem
+// held: checksums of pages as target reported them (Q), -1 = unknown
+// Rows found by checksum only must be read back in full: R means the page
+// itself may already be right, C from a page not present may be a false match
+char plan_row(uint16_t *pgmem,uint8_t page,bool *present,int16_t *held,uint8_t *pcmd,size_t *size) {
+	uint16_t *row=&pgmem[page<<5];
+	uint8_t sum=0;
+	int z;
+	for(z=1;z<0x20;z++) {
+		if(row[z]!=row[0]) break;
+	}
+	if(z==0x20) {
+		pcmd[0]=page;
+		pcmd[1]=row[0]>>8;
+		pcmd[2]=row[0]&0xFF;
+		pcmd[3]=pcmd[0]+pcmd[1]+pcmd[2];
+		*size=4;
+		return 'F';
+	}
+	for(z=0;z<0x80;z++) {
+		if(present[z]&&z!=page&&memcmp(&pgmem[z<<5],row,0x20*sizeof(uint16_t))==0) {
+			pcmd[0]=page;
+			pcmd[1]=z;
+			pcmd[2]=pcmd[0]+pcmd[1];
+			*size=3;
+			return 'C';
+		}
+	}
+	// Checksums R gives cover page number and data
+	for(z=0;z<0x20;z++) sum+=(row[z]>>8)+(row[z]&0xFF);
+	if(held[page]==(uint8_t)(page+sum)) {
+		pcmd[0]=page;
+		*size=1;
+		return 'R';
+	}
+	for(z=0;z<0x80;z++) {
+		if(!present[z]&&z!=page&&held[z]==(uint8_t)(z+sum)) {
+			pcmd[0]=page;
+			pcmd[1]=z;
+			pcmd[2]=pcmd[0]+pcmd[1];
+			*size=3;
+			return 'C';
+		}
+	}
+	make_row(pgmem,page,pcmd);
+	*size=66;
+	return 'W';
+}
+
+// CRC-32 of program memory, identifies the image in the download journal
+uint32_t image_crc(uint16_t *pgmem) {
+	uint32_t crc=0xFFFFFFFF;
+	int n,b;
+	for(n=0;n<0x1000;n++) {
+		crc^=pgmem[n];
+		for(b=0;b<16;b++) crc=(crc>>1)^(0xEDB88320&-(crc&1));
+	}
+	return ~crc;
+}
+
 #define ACK 0x06
-#define NAK 0x10
+#define NAK 0x15
+// Wake carrier byte, alternating bits
+#define WAKE 0x55
+// Start of v2 frame
+#define SYNC 0xA5
 
-bool command(char cmd,uint8_t *in,size_t insz,uint8_t *out,size_t outsz) {
+// Transport to target
+transport_t *port;
+
+// Protocol version spoken by target, see probe()
+uint8_t protocol=1;
+
+// Optional commands built into target, see properties()
+#define FEATURE_ROWS    0x01 // F, C
+#define FEATURE_LINK    0x02 // L, T
+#define FEATURE_EEPROM  0x04 // E, D
+#define FEATURE_SPEAKER 0x08 // S
+#define FEATURE_BATTERY 0x10 // B
+uint8_t features=0;
+
+// End of protected bootloader area, applications start here
+uint16_t boot_end=0x200;
+
+// Suppress command failure reports, for link test
+bool quiet=false;
+
+// Report command failure
+void report(char *msg) {
+	if(!quiet) printf("%s\n",msg);
+}
+
+// CRC-8, polynomial 0x07
+uint8_t crc8(uint8_t crc,uint8_t data) {
+	int n;
+	crc^=data;
+	for(n=0;n<8;n++) crc=(crc&0x80)?(crc<<1)^0x07:(crc<<1);
+	return crc;
+}
+
+// Read and discard incoming data until the line has been quiet for a while
+void drain(void) {
+	do {
+		tflush(port);
+	} while(twait(port,1,tdeadline(50)));
+}
+
+// Send wake carrier until bootloader answers, which it does to any unknown
+// command byte - fast booting bootloaders only stay if carrier is present at reset
+bool wake(uint32_t baud,uint32_t timeout) {
+	uint8_t carrier[0x100];
+	uint16_t chunk=baud/640; // ~15ms worth of bytes per write
+	uint32_t deadline=tdeadline(timeout);
+	memset(carrier,WAKE,sizeof(carrier));
+	if(chunk>sizeof(carrier)) chunk=sizeof(carrier);
+	while((int32_t)(deadline-tnow())>0) {
+		// Poll without waiting, so the next chunk follows at once and the line
+		// never idles for longer than the bootloader's carrier window
+		twrite(port,carrier,chunk,deadline);
+		if(twait(port,1,tnow())) {
+			drain();
+			return true;
+		}
+	}
+	return false;
+}
+
+// Send command as one v2 frame: SYNC, command, length, payload, CRC
+// Response is SYNC, ACK, data, CRC - CRC covers all but SYNC
+bool command_v2(char cmd,uint8_t *in,size_t insz,uint8_t *out,size_t outsz) {
+	uint8_t frame[0x100];
+	uint8_t *p_span;
+	uint8_t retry;
+	uint8_t crc,sync=0,status=0;
+	size_t got,n;
+	uint16_t span;
+	uint32_t deadline;
+	// Flush
+	tflush(port);
+
+	frame[0]=SYNC;
+	frame[1]=cmd;
+	frame[2]=insz;
+	if(insz) memcpy(&frame[3],in,insz);
+	crc=0;
+	for(n=1;n<insz+3;n++) crc=crc8(crc,frame[n]);
+	frame[insz+3]=crc;
+
+	for(retry=0,got=0;retry<3&&!got;retry++) {
+		twrite(port,frame,insz+4,tdeadline(1000));
+		deadline=tdeadline(1000);
+		// Take response straight from the receive ring, only data is copied
+		crc=0;
+		while(got<outsz+3) {
+			if(!(span=tspan(port,&p_span))) {
+				if(!twait(port,1,deadline)) break;
+				continue;
+			}
+			if(span>outsz+3-got) span=outsz+3-got;
+			for(n=0;n<span;n++,got++) {
+				if(got) crc=crc8(crc,p_span[n]);
+				if(got==0)            sync=p_span[n];
+				else if(got==1)       status=p_span[n];
+				else if(got<outsz+2)  out[got-2]=p_span[n];
+			}
+			tconsume(port,span);
+			if(got>=2&&status!=ACK) break;
+		}
+	}
+
+	if(!got) {
+		report("Device does not respond to command");
+		return false;
+	}
+
+	if(sync!=SYNC||got<2) {
+		report("Device protocol mismatch - response format");
+		return false;
+	} else if(status==NAK) {
+		report("Device was unable to execute command");
+		return false;
+	} else if(status!=ACK) {
+		report("Device protocol mismatch - response format");
+		return false;
+	}
+
+	if(got!=outsz+3) {
+		report("Device protocol mismatch - response size");
+		return false;
+	}
+
+	if(crc) {
+		report("Response CRC mismatch");
+		return false;
+	}
+
+	return true;
+}
+
+// Ask target for its protocol version with a v2 frame
+// v1 bootloaders answer each byte of it as an unknown command instead
+void probe(void) {
+	uint8_t frame[4]={SYNC,'I',0x00,0x00};
+	uint8_t resp[4];
+	size_t got=0;
+	uint32_t deadline=tdeadline(200);
+	frame[3]=crc8(crc8(0,frame[1]),frame[2]);
+	tmark(port,'I');
+	twrite(port,frame,sizeof(frame),deadline);
+	while(got<sizeof(resp)&&tread(port,&resp[got],1,deadline)) {
+		got++;
+		if(resp[0]!=SYNC) break;
+	}
+	if(got==sizeof(resp)&&resp[1]==ACK&&crc8(crc8(crc8(0,resp[1]),resp[2]),resp[3])==0) {
+		protocol=resp[2];
+	} else {
+		protocol=1;
+	}
+	drain();
+}
+
+// Send command byte, wait for expected length, then send payload
+bool command_v1(char cmd,uint8_t *in,size_t insz,uint8_t *out,size_t outsz) {
 	uint8_t retry;
 	size_t avail;
 	uint8_t dummy;
-	uint16_t time;
 	// Flush
-	avail=speek();
-	while(avail--) sread(&dummy,1);
+	tflush(port);
 	
 	for(retry=0;retry<3;retry++) {
-		swrite(&cmd,1);
-		for(time=0;time<500;time++) {
-			Sleep(1);
-			avail=speek();
-			if(avail) break;
-		}
+		twrite(port,&cmd,1,tdeadline(500));
+		avail=twait(port,1,tdeadline(500));
 		if(avail) break;		
 	}
 	
 	if(!avail) {
-		printf("Device does not respond to command\n");
+		report("Device does not respond to command");
 		return false;
 	}
 
-	sread(&dummy,1);
+	tread(port,&dummy,1,tnow());
 	
 	if(dummy!=insz+1) {
-		printf("Device protocol mismatch - command size\n");
+		report("Device protocol mismatch - command size");
 		return false;
 	}
 	
-	swrite(in,insz);
+	twrite(port,in,insz,tdeadline(1000));
 
-	for(time=0;time<1000;time++) {
-		Sleep(1);
-		avail=speek();
-		if(avail>=outsz+1) break;
-	}
+	avail=twait(port,outsz+1,tdeadline(1000));
 	if(avail) {
 		avail--;
-		sread(&dummy,1);
+		tread(port,&dummy,1,tnow());
 		if(dummy==NAK) {
-			printf("Device was unable to execute command\n");
+			report("Device was unable to execute command");
 			return false;
 		} else if(dummy!=ACK) {
-			printf("Device protocol mismatch - response format\n");
+			report("Device protocol mismatch - response format");
 			return false;
 		}
 	} else {
-		printf("Response was not received in a timely fashion\n");
+		report("Response was not received in a timely fashion");
 		return false;
 	}
 	
 	if(avail!=outsz) {
-		printf("Device protocol mismatch - response size\n");
+		report("Device protocol mismatch - response size");
 		return false;
 	}
 	
-	if(outsz) sread(out,outsz);
+	if(outsz) tread(port,out,outsz,tnow());
 	
 	return true;
 	
 }
 
+// Send command using protocol spoken by target
+bool command(char cmd,uint8_t *in,size_t insz,uint8_t *out,size_t outsz) {
+	tmark(port,cmd);
+	if(protocol>=2) return command_v2(cmd,in,insz,out,outsz);
+	return command_v1(cmd,in,insz,out,outsz);
+}
+
+// Ask target for protected area and optional commands
+// Compact builds only speak v1, so P is tried whatever probe() found.
+// Older targets refuse it, their commands follow from the protocol version
+void properties(void) {
+	uint8_t resp[2];
+	quiet=true;
+	if(command('P',NULL,0,resp,2)) {
+		boot_end=resp[0]<<5;
+		features=resp[1];
+	} else {
+		// The original v1 bootloader has S and B only, v2 brought E, D, L and T,
+		// v3 F and C
+		boot_end=0x200;
+		features=FEATURE_SPEAKER|FEATURE_BATTERY;
+		if(protocol>=2) features|=FEATURE_LINK|FEATURE_EEPROM;
+		if(protocol>=3) features|=FEATURE_ROWS;
+	}
+	quiet=false;
+}
+
+// Send message to running application: SYNC, type, length, payload, CRC
+// Application answers ACK, or NAK if the frame was damaged
+bool send_message(uint8_t *msg,size_t size) {
+	uint8_t frame[SEND_MAX+4];
+	uint8_t resp;
+	size_t n;
+	int retry;
+	frame[0]=SYNC;
+	frame[1]=msg[0];
+	frame[2]=size-1;
+	memcpy(&frame[3],&msg[1],size-1);
+	frame[size+2]=0;
+	for(n=1;n<size+2;n++) frame[size+2]=crc8(frame[size+2],frame[n]);
+	for(retry=0;retry<3;retry++) {
+		if(retry) printf("Trying again...\n");
+		tflush(port);
+		twrite(port,frame,size+3,tdeadline(1000));
+		if(tread(port,&resp,1,tdeadline(500))&&resp==ACK) return true;
+	}
+	return false;
+}
+
+// Link settings selectable by L command, link test parameters
+const uint32_t link_rates[4]={9600,19200,38400,57600};
+const uint8_t link_levels[]={16,32,48,64,96,128,160,192,224};
+#define LINK_TEST 16     // Pattern bytes echoed by one T command
+#define LINK_FRAMES 8    // T commands per setting
+#define LINK_REVERT 3000 // Time for target to drop L settings nobody talks to, ms
+
+// Configure transport baudrate
+bool set_baud(uint32_t baud) {
+	return tconfig(port,baud);
+}
+
+// Switch target and serial port to baudrate and analog level (0 = default)
+bool link_set(uint32_t baud,uint8_t level) {
+	uint8_t plink[2];
+	for(plink[0]=0;plink[0]<4;plink[0]++) {
+		if(link_rates[plink[0]]==baud) break;
+	}
+	if(plink[0]==4) return false;
+	plink[1]=level;
+	if(!command('L',plink,2,NULL,0)) return false;
+	return set_baud(baud);
+}
+
+// Echo LINK_FRAMES test patterns, count bit errors and bits sent both ways
+// A lost frame counts as half its bits wrong
+void link_measure(uint32_t *bits,uint32_t *errors,uint32_t *framing) {
+	uint8_t pattern[LINK_TEST];
+	uint8_t resp[LINK_TEST+2];
+	uint8_t diff;
+	int n,z,lost=0;
+	for(n=0;n<LINK_FRAMES;n++) {
+		for(z=0;z<LINK_TEST;z++) {
+			pattern[z]=z<4?"\x55\xAA\x00\xFF"[z]:rand();
+		}
+		*bits+=LINK_TEST*16;
+		if(lost<2&&command('T',pattern,LINK_TEST,resp,LINK_TEST+2)) {
+			for(z=0;z<LINK_TEST;z++) {
+				for(diff=pattern[z]^resp[z];diff;diff>>=1) *errors+=diff&1;
+			}
+			*framing+=(resp[LINK_TEST]<<8)|resp[LINK_TEST+1];
+			lost=0;
+		} else {
+			// Give up on setting after two lost frames in a row
+			*errors+=LINK_TEST*8;
+			lost++;
+		}
+	}
+}
+
+// Sweep baudrates and levels, report bit error rates and recommend a setting
+// Uses v1 framing, so corrupted bytes are echoed instead of rejected by CRC
+void link_test(uint32_t baud) {
+	uint8_t resp[LINK_TEST+2];
+	uint8_t pattern[LINK_TEST];
+	uint32_t bits,errors,framing;
+	bool clean[4][sizeof(link_levels)];
+	uint8_t saved=protocol;
+	int r,l,run,best_run=0,best_rate=-1,best_level=0;
+	srand(GetTickCount());
+	protocol=1;
+	quiet=true;
+	memset(clean,0,sizeof(clean));
+	memset(pattern,WAKE,sizeof(pattern));
+	printf("Baud   Level  Bits    Errors  Framing  BER\n");
+	for(r=0;r<4;r++) {
+		for(l=0;l<sizeof(link_levels);l++) {
+			if(!link_set(link_rates[r],link_levels[l])) {
+				printf("%-6u %-6u not supported by target\n",link_rates[r],link_levels[l]);
+				set_baud(baud);
+				break;
+			}
+			// Clear framing errors counted before the switch
+			command('T',pattern,LINK_TEST,resp,LINK_TEST+2);
+			bits=errors=framing=0;
+			link_measure(&bits,&errors,&framing);
+			printf("%-6u %-6u %-7u %-7u %-8u %.1e\n",link_rates[r],link_levels[l],bits,errors,framing,(double)errors/bits);
+			clean[r][l]=!errors&&!framing;
+			// Back to defaults, or wait for target to fall back by itself
+			if(!link_set(baud,0)) {
+				Sleep(LINK_REVERT);
+				set_baud(baud);
+				drain();
+			}
+		}
+	}
+	protocol=saved;
+	quiet=false;
+	// Fastest rate with the widest run of clean levels, at least two for margin
+	for(r=3;r>=0&&best_rate<0;r--) {
+		for(l=0,run=0;l<=sizeof(link_levels);l++) {
+			if(l<sizeof(link_levels)&&clean[r][l]) {
+				run++;
+			} else {
+				if(run>=2&&run>best_run) {
+					best_run=run;
+					best_rate=r;
+					best_level=link_levels[l-1-run/2];
+				}
+				run=0;
+			}
+		}
+	}
+	if(best_rate>=0) {
+		printf("Recommended setting: --link %u,%u\n",link_rates[best_rate],best_level);
+	} else {
+		printf("No reliable setting found\n");
+	}
+}
+
 int main(int argc,char**argv) {
 	char *firmware=NULL;
+	char *eeprom=NULL;
 	char *device=NULL;
+	uint32_t baud=0;
+	char *message=NULL;
+	char *tracefile=NULL;
+	size_t msize=0;
+	uint32_t link_baud=0;
+	unsigned int link_level=0;
+	bool linktest=false;
 	int n,z;
 	int retry;
 	uint8_t flags=0;
 	printf("PicOptic download utility v1.0\n");
-	if(argc>1) firmware=argv[1];
-	for(n=2;n<argc;n++) {
+	for(n=1;n<argc;n++) {
 		if(strcmp("-?",argv[n])==0) {
 			help_out(true);
 		} else if(strcmp("-p",argv[n])==0) {
@@ -134,17 +646,39 @@ int main(int argc,char**argv) {
 			flags|=IGNORE_BATTERY;
 		} else if(strcmp("-m",argv[n])==0) {
 			flags|=DISPLAY_MAP;
+		} else if(strcmp("--eeprom",argv[n])==0) {
+			if(n+1<argc) eeprom=argv[++n];
+		} else if(strcmp("-s",argv[n])==0) {
+			if(n+1<argc) baud=atoi(argv[++n]);
+		} else if(strcmp("--link",argv[n])==0) {
+			if(n+1<argc) sscanf(argv[++n],"%u,%u",&link_baud,&link_level);
+		} else if(strcmp("--link-test",argv[n])==0) {
+			linktest=true;
+		} else if(strcmp("--trace",argv[n])==0) {
+			if(n+1<argc) tracefile=argv[++n];
+		} else if(strcmp("--send",argv[n])==0) {
+			if(n+1<argc) message=argv[++n];
 		} else if(strcmp("-o",argv[n])==0) {
 			if(n+1<argc) device=argv[++n];
 		} else if(argv[n][0]=='-'&&argv[n][1]=='o') {
 			if(strlen(&argv[n][2])) device=&argv[n][2];
+		} else if(argv[n][0]!='-'&&!firmware) {
+			firmware=argv[n];
 		} else {
 			printf("Unknown option %s\n",argv[n]);
 			help_out(false);
 			exit(1);
 		}
 	}
-	if(!firmware) {
+	if(message) {
+		msize=strlen(message)/2;
+		if(!crunch(message)||msize<1||msize>SEND_MAX+1) {
+			printf("Message must be 1 to %u hex bytes\n",SEND_MAX+1);
+			exit(1);
+		}
+	}
+	if(!baud) baud=message?SEND_BAUD:9600;
+	if(!firmware&&!eeprom&&!linktest&&!message) {
 		printf("No firmware specified\n");
 		help_out(false);
 		exit(1);
@@ -155,102 +689,30 @@ int main(int argc,char**argv) {
 		exit(1);
 	}
 	
-	// Convert hex file to memory model
+	// Convert hex files to memory model
 	uint16_t pgmem[0x1000];
+	uint16_t eemem[0x100];
 	for(n=0;n<0x1000;n++) {
 		pgmem[n]=0x3FFF;
 	}
-	FILE *f=fopen(firmware,"r");
-	if(!f) {
-		printf("Failed to open firmware file %s\n",firmware);
-		exit(1);
+	for(n=0;n<0x100;n++) {
+		eemem[n]=0xFFFF;
 	}
-	char record[256];
-	uint32_t lnum=0;
-	bool read_ok=true;
-	size_t llen;
-	uint32_t addr=0x00000000;
-	while(read_ok&&!feof(f)) {
-		lnum++;
-		fgets(record,sizeof(record),f);
-		if(record[strlen(record)-1]==0x0A) record[strlen(record)-1]=0;
-		llen=strlen(record);
-		if(llen) {
-			if(record[0]!=':') {
-				printf("%s:%i record does not start with ':'\n",firmware,lnum);
-				read_ok=false;
-			} else if((llen&1)==0) {
-				printf("%s:%i record is of incorrect length\n",firmware,lnum);
-				read_ok=false;
-			} else if(!crunch(&record[1])) {
-				printf("%s:%i record contains bad characters\n",firmware,lnum);
-				read_ok=false;
-			} else {
-				llen>>=1;
-				if(llen<5) {
-					printf("%s:%i record length below minimum\n",firmware,lnum);
-					read_ok=false;
-				} else if(llen!=record[1]+5) {
-					printf("%s:%i record length/byte count field mismatch\n",firmware,lnum);
-					read_ok=false;
-				} else {
-					uint8_t count=record[1];
-					addr&=0xFFFF0000;
-					addr|=(((uint8_t)record[2])<<8)|((uint8_t)record[3]);
-					uint8_t type=record[4];
-					uint8_t *p_data=&record[5];
-					uint8_t csum=0;
-					for(n=1;n<5+count;n++) csum+=record[n];
-					csum=(~csum)+1;
-					if(csum!=(uint8_t)record[5+count]) {
-						printf("%s:%i checksum mismatch\n",firmware,lnum);
-						read_ok=false;
-					} else {
-						if(type==0x00) {
-							while(count--) {
-								if(addr>=0x2000) {
-									if(!(flags&IGNORE_OUTOFRANGE)) {
-										printf("%s:%i address out of range\n",firmware,lnum);
-										read_ok=false;
-										break;
-									}
-								} else {
-									if(addr&1) {
-										pgmem[addr>>1] = (pgmem[addr>>1] & 0x00FF) | (*p_data++) << 8;
-									} else {
-										pgmem[addr>>1] = (pgmem[addr>>1] & 0xFF00) | *p_data++;
-									}
-									addr++;
-								}
-							}
-						} else if(type==0x01) {
-							if(count) {
-								printf("%s:%i bad byte count for \"end of file\" record\n",firmware,lnum);
-								read_ok=false;
-							}
-							break;
-						} else if(type==0x04) {
-							if((addr&0x0000FFFF)!=0x00000000) {
-								printf("%s:%i bad address for \"extended linear address\" record\n",firmware,lnum);
-								read_ok=false;
-							} else if(count!=2) {
-								printf("%s:%i incorrect byte count for \"extended linear address\" record\n",firmware,lnum);
-								read_ok=false;
-							} else {
-								addr=(((uint8_t)record[5])<<24)|(((uint8_t)record[6])<<16);
-							}
-						} else {
-							printf("%s:%i this record type is not supported\n",firmware,lnum);
-							read_ok=false;
-						}
-					}
-				}
-			}
+	if(firmware) {
+		if(!load_hex(firmware,pgmem,eemem,flags)) exit(1);
+		printf("Firmware file loaded\n");
+	}
+	if(eeprom) {
+		if(!load_hex(eeprom,pgmem,eemem,flags)) exit(1);
+		printf("EEPROM file loaded\n");
+	}
+	if(eemem[EEPROM_MARKER]<=0xFF) {
+		if(!(flags&IGNORE_PROTECTED)) {
+			printf("Attempted to write protected area\n");
+			exit(1);
 		}
+		eemem[EEPROM_MARKER]=0xFFFF;
 	}
-	fclose(f);
-	if(!read_ok) exit(1);
-	printf("Firmware file loaded\n");
 	if(flags&DISPLAY_MAP) {
 		char map[0x40+1];
 		map[0x40]=0;
@@ -261,59 +723,199 @@ int main(int argc,char**argv) {
 			}
 			if(strchr(map,'X')) printf("%08X %s\n", n, map);
 		}
+		for(n=0;n<0x100;n+=0x40) {
+			memset(map,'-',0x40);
+			for(z=0;z<0x40;z++) {
+				if(eemem[n+z]<=0xFF) map[z]='E';
+			}
+			if(strchr(map,'E')) printf("%08X %s\n", (EEPROM_HEX>>1)+n, map);
+		}
+	}
+	if(!(port=topen(device))) {
+		printf("Unable to open %s\n",device);
+		exit(1);
 	}
-	if(!sopen(device)) {
-		printf("Unable to open serial port %s\n",device);
+	if(tracefile&&!ttrace(port,tracefile)) {
+		printf("Unable to create trace file %s\n",tracefile);
+		tclose(port);
 		exit(1);
 	}
-	if(!sconfig("9600,N,8,1")) {
-		printf("Unable to configure serial port %s\n",device);
-		sclose();
+	if(!set_baud(baud)) {
+		printf("Unable to configure %s\n",device);
+		tclose(port);
 		exit(1);
 	}
-	printf("Serial port is open\n");
+	printf("Port is open\n");
+
+	if(message) {
+		if(!send_message((uint8_t*)message,msize)) {
+			printf("Message was not acknowledged\n");
+			tclose(port);
+			exit(1);
+		}
+		printf("Message acknowledged\n");
+		tclose(port);
+		exit(0);
+	}
 	
-	Sleep(1000);
+	printf("Waiting for target, reset it now...\n");
+	if(!wake(baud,10000)) {
+		printf("Target did not respond\n");
+		tclose(port);
+		exit(1);
+	}
+	probe();
+	properties();
+	printf("Target speaks protocol v%i, bootloader occupies 0x000-0x%03X\n",protocol,boot_end-1);
+
+	if((linktest||link_baud)&&!(features&FEATURE_LINK)) {
+		printf("Target does not support link settings\n");
+		tclose(port);
+		exit(1);
+	}
+	if(!(features&FEATURE_EEPROM)) {
+		// Firmware hex files may carry data EEPROM contents too
+		for(n=0;n<0x100;n++) {
+			if(eemem[n]<=0xFF) {
+				printf("Target does not support data EEPROM writes\n");
+				tclose(port);
+				exit(1);
+			}
+		}
+	}
+	if(linktest) {
+		link_test(baud);
+		tclose(port);
+		exit(0);
+	}
+	if(link_baud) {
+		if(!link_set(link_baud,link_level)) {
+			printf("Unable to switch link to %u baud, level %u\n",link_baud,link_level);
+			tclose(port);
+			exit(1);
+		}
+		printf("Link switched to %u baud, level %u\n",link_baud,link_level);
+	}
 	
-	uint8_t pwrite[66],pread[1],pbuzz[2];
+	uint8_t pwrite[66],pread[2],pbuzz[2],pplan[66];
+	size_t plansz;
+	char plan;
+	int planned[4]={0,0,0,0};
+	int16_t held[0x80];
+	uint8_t psums[0x80];
+	uint8_t pdata[EEPROM_BLOCK+3];
 	uint8_t resp[65];
 	
 	// Verify battery voltage
-	command('B',NULL,0,resp,2);
-	uint16_t battery=(resp[0]<<8)|resp[1];
-	float voltage=1.024/((float)battery/65535.0);
-	printf("Battery voltage is %2.3f\n",voltage);
-	if(voltage<2.0&&!(flags&IGNORE_BATTERY)) {
-		printf("Voltage is too low\n");
-		sclose();
-		exit(1);
+	if(features&FEATURE_BATTERY) {
+		command('B',NULL,0,resp,2);
+		uint16_t battery=(resp[0]<<8)|resp[1];
+		float voltage=1.024/((float)battery/65535.0);
+		printf("Battery voltage is %2.3f\n",voltage);
+		if(voltage<2.0&&!(flags&IGNORE_BATTERY)) {
+			printf("Voltage is too low\n");
+			tclose(port);
+			exit(1);
+		}
+	}
+
+	// Check image-valid marker, cleared by the bootloader while a download is in progress
+	// If it can not be read the image may be incomplete, so it is not started
+	bool image_ok=true;
+	if(features&FEATURE_EEPROM) {
+		pread[0]=EEPROM_MARKER;
+		pread[1]=1;
+		for(retry=0;retry<3;retry++) {
+			if(command('D',pread,2,resp,2)&&resp[1]==(uint8_t)(EEPROM_MARKER+resp[0])) break;
+		}
+		if(retry==3) printf("Unable to read image-valid marker\n");
+		image_ok=retry<3&&resp[0]!=0x00;
 	}
 
-	printf("Downloading firmware...\n");
+	// Journal confirmed pages, resume if target holds a partial download of this image
+	bool confirmed[0x80];
+	char jname[MAX_PATH];
+	FILE *journal=NULL;
+	int last=-1;
+	memset(confirmed,0,sizeof(confirmed));
+	for(n=0;n<0x80;n++) held[n]=-1;
+	if(firmware) {
+		uint32_t crc=image_crc(pgmem);
+		snprintf(jname,sizeof(jname),"%s.journal",firmware);
+		// Rows target holds, a previous image may have them at other pages
+		if((features&FEATURE_ROWS)&&protocol>=5) {
+			pread[0]=boot_end>>5;
+			pread[1]=0x80-pread[0];
+			if(command('Q',pread,2,psums,pread[1])) {
+				for(n=0;n<pread[1];n++) held[pread[0]+n]=psums[n];
+			}
+		}
+		if(!image_ok&&(journal=fopen(jname,"r"))) {
+			uint32_t jcrc;
+			unsigned int page;
+			if(fscanf(journal,"%08X",&jcrc)==1&&jcrc==crc) {
+				while(fscanf(journal,"%02X",&page)==1) {
+					if(page<0x80) confirmed[last=page]=true;
+				}
+			}
+			fclose(journal);
+			// Journal could belong to another target, check every page it lists
+			// against the checksums from Q, or read them back without those
+			for(page=0;page<0x80&&last>=0;page++) {
+				if(!confirmed[page]) continue;
+				make_row(pgmem,page,pwrite);
+				pread[0]=page;
+				if(held[page]>=0?held[page]!=pwrite[65]:
+				   !command('R',pread,1,resp,65)||memcmp(resp,&pwrite[1],65)!=0) {
+					memset(confirmed,0,sizeof(confirmed));
+					last=-1;
+				}
+			}
+			if(last>=0) printf("Resuming download from journal\n");
+		}
+		journal=fopen(jname,last>=0?"a":"w");
+		if(journal&&last<0) fprintf(journal,"%08X\n",crc);
+		printf("Downloading firmware...\n");
+	}
 	for(n=0;n<0x1000;n+=0x20) {
 		for(z=0;z<0x20;z++) {
 			if(pgmem[n+z]!=0x3FFF) break;
 		}
 		if(z!=0x20) {
 			pwrite[0]=n>>5;
-			if(pwrite[0]<0x10) {
+			if(pwrite[0]<(boot_end>>5)) {
 				if(!(flags&IGNORE_PROTECTED)) {
 					printf("Attempted to write protected area\n");
-					sclose();
+					tclose(port);
 					exit(1);
 				}
-			} else {
-				uint8_t csum=pwrite[0];
-				for(z=0;z<0x20;z++) {
-					pwrite[(z<<1)+1]=pgmem[n+z]>>8;
-					csum+=pgmem[n+z]>>8;
-					pwrite[(z<<1)+2]=pgmem[n+z]&0xFF;
-					csum+=pgmem[n+z]&0xFF;
-				}
-				pwrite[65]=csum;
+			} else if(!confirmed[pwrite[0]]) {
+				make_row(pgmem,pwrite[0],pwrite);
+				// Rows target can rebuild itself, from pages it already holds
+				plan='W';
+				if(features&FEATURE_ROWS) plan=plan_row(pgmem,pwrite[0],confirmed,held,pplan,&plansz);
 				for(retry=0;retry<3;retry++) {
 					if(retry) printf("Trying again...\n");
-					if(command('W',pwrite,66,NULL,0)) {
+					if(plan=='R') {
+						// Checksum says page is already there, make sure, else write it
+						pread[0]=pwrite[0];
+						if(command('R',pread,1,resp,65)&&memcmp(resp,&pwrite[1],65)==0) break;
+						plan='W';
+					}
+					if(plan!='W') {
+						// Answer is checksum of page as written, same as R gives
+						if(command(plan,pplan,plansz,resp,1)) {
+							if(resp[0]==pwrite[65]) {
+								if(plan=='F'||confirmed[pplan[1]]) break;
+								// Source found by checksum only, read all of it back
+								pread[0]=pwrite[0];
+								if(command('R',pread,1,resp,65)&&memcmp(resp,&pwrite[1],65)==0) break;
+							}
+							printf("Verify failed\n");
+						}
+						// Fall back to plain write
+						plan='W';
+					} else if(command('W',pwrite,66,NULL,0)) {
 						pread[0]=pwrite[0];
 						if(command('R',pread,1,resp,65)) {
 							if(memcmp(resp,&pwrite[1],65)==0) break;
@@ -323,25 +925,87 @@ int main(int argc,char**argv) {
 				}
 				if(retry==3) {
 					
-					printf("Download failed\n");
-					sclose();
+					printf("Download failed, run again to resume\n");
+					tclose(port);
 					exit(1);
 				}
+				if(journal) {
+					fprintf(journal,"%02X\n",pwrite[0]);
+					fflush(journal);
+				}
+				confirmed[pwrite[0]]=true;
+				held[pwrite[0]]=-1;
+				planned[plan=='W'?0:plan=='F'?1:plan=='C'?2:3]++;
 			}
 		}
 	}
+	if(firmware) {
+		printf("%i pages written, %i filled, %i copied, %i unchanged\n",planned[0],planned[1],planned[2],planned[3]);
+		if(journal) fclose(journal);
+		remove(jname);
+		image_ok=true;
+	}
+
+	// Write data EEPROM in runs of up to EEPROM_BLOCK bytes
+	for(n=0;n<0x100;n++) {
+		if(eemem[n]<=0xFF) break;
+	}
+	if(n<0x100) printf("Writing data EEPROM...\n");
+	for(;n<0x100;n+=z) {
+		for(z=0;z<EEPROM_BLOCK&&n+z<0x100;z++) {
+			if(eemem[n+z]>0xFF) break;
+		}
+		if(z==0) {
+			z=1;
+		} else {
+			memset(pdata,0xFF,sizeof(pdata));
+			pdata[0]=n;
+			pdata[1]=z;
+			for(int i=0;i<z;i++) pdata[i+2]=eemem[n+i];
+			uint8_t csum=0;
+			for(int i=0;i<EEPROM_BLOCK+2;i++) csum+=pdata[i];
+			pdata[EEPROM_BLOCK+2]=csum;
+			// Read back checksum covers address and data only
+			csum-=pdata[1];
+			for(int i=z;i<EEPROM_BLOCK;i++) csum-=pdata[i+2];
+			for(retry=0;retry<3;retry++) {
+				if(retry) printf("Trying again...\n");
+				if(command('E',pdata,EEPROM_BLOCK+3,NULL,0)) {
+					pread[0]=pdata[0];
+					pread[1]=pdata[1];
+					if(command('D',pread,2,resp,z+1)) {
+						if(memcmp(resp,&pdata[2],z)==0&&resp[z]==csum) break;
+						printf("Verify failed\n");
+					}
+				}
+			}
+			if(retry==3) {
+				printf("Download failed\n");
+				tclose(port);
+				exit(1);
+			}
+		}
+	}
+
 	printf("Download successful!\n");
-	pbuzz[0]=50;
-	pbuzz[1]=2;
-	uint8_t dummy;
-	command('S',pbuzz,2,&dummy,1);
-	pbuzz[0]=48;
-	pbuzz[1]=4;
-	Sleep(100);
-	command('S',pbuzz,2,&dummy,1);
-	swrite("X",1);
-
-	sclose();
+	if(features&FEATURE_SPEAKER) {
+		pbuzz[0]=50;
+		pbuzz[1]=2;
+		uint8_t dummy;
+		command('S',pbuzz,2,&dummy,1);
+		pbuzz[0]=48;
+		pbuzz[1]=4;
+		Sleep(100);
+		command('S',pbuzz,2,&dummy,1);
+	}
+	if(image_ok) {
+		tmark(port,'X');
+		twrite(port,"X",1,tdeadline(1000));
+	} else {
+		printf("Firmware image is incomplete, target stays in bootloader\n");
+	}
+
+	tclose(port);
 	
 	exit(0);
 }
\ No newline at end of file
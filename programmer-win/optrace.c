@@ -0,0 +1,221 @@
+// Link trace tool, works on traces recorded by optic --trace
+//
+// analyze: splits each command into link time (bytes on the wire at 8N1),
+//          device time (from request on the wire to answer starting) and
+//          host time (the rest: turnaround, latency, retries)
+// replay:  sends recorded traffic to a transport, by default the simulated
+//          bootloader, and compares answers with the recorded ones
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <windows.h>
+#include "transport.h"
+#include "trace.h"
+
+void help_out(void) {
+	printf("Useage: optrace analyze trace.bin\n");
+	printf("        optrace replay trace.bin [-o device] [--fast]\n");
+	printf("-o device      transport to replay to, as for optic (default loop)\n");
+	printf("--fast         do not keep recorded timing\n");
+}
+
+// Time bytes spend on the wire at 8N1, us
+uint64_t wire(uint32_t bytes,uint32_t baud) {
+	return (uint64_t)bytes*10*1000000/baud;
+}
+
+// Traffic of one command, from its start to the start of the next one
+typedef struct {
+	uint8_t id;      // command identifier, 0 = wake up before first command
+	uint64_t start;
+	uint64_t end;
+	uint32_t tx;     // bytes sent
+	uint32_t rx;     // bytes received
+	uint64_t link;   // us
+	uint64_t device; // us
+} segment_t;
+
+// Print one command, add it to totals
+void segment_out(segment_t *seg,uint32_t number,segment_t *total) {
+	uint64_t time=seg->end-seg->start;
+	uint64_t busy=seg->link+seg->device;
+	uint64_t host=time>busy?time-busy:0;
+	if(seg->id) printf("%-6u %c    ",number,seg->id);
+	else        printf("%-6s %-4s ","-","wake");
+	printf("%-6u %-6u %9.1f %9.1f %9.1f %9.1f\n",seg->tx,seg->rx,time/1000.0,seg->link/1000.0,seg->device/1000.0,host/1000.0);
+	total->tx+=seg->tx;
+	total->rx+=seg->rx;
+	total->end+=time;
+	total->link+=seg->link;
+	total->device+=seg->device;
+}
+
+void analyze(trace_t *trace) {
+	trace_event_t ev;
+	segment_t seg,total;
+	uint32_t baud=9600;
+	uint32_t number=0;
+	uint64_t sent=0;       // time of last write
+	uint32_t sent_bytes=0; // bytes in last write
+	bool waiting=false;    // host wrote, target has not answered yet
+	uint64_t host;
+	memset(&seg,0,sizeof(seg));
+	memset(&total,0,sizeof(total));
+	printf("#      Cmd  Tx     Rx     Total ms  Link ms   Device ms Host ms\n");
+	while(trace_next(trace,&ev)) {
+		if(ev.kind==TRACE_MARK) {
+			if(seg.tx||seg.rx) {
+				seg.end=ev.time;
+				segment_out(&seg,number,&total);
+			}
+			memset(&seg,0,sizeof(seg));
+			seg.id=ev.data[0];
+			seg.start=ev.time;
+			number++;
+			waiting=false;
+		} else if(ev.kind==TRACE_CONFIG) {
+			baud=ev.data[0]|(ev.data[1]<<8)|(ev.data[2]<<16)|(ev.data[3]<<24);
+		} else if(ev.kind==TRACE_TX) {
+			// Long writes are split into events with the same time
+			if(waiting&&ev.time==sent) {
+				sent_bytes+=ev.size;
+			} else {
+				sent=ev.time;
+				sent_bytes=ev.size;
+			}
+			waiting=true;
+			seg.tx+=ev.size;
+			seg.link+=wire(ev.size,baud);
+		} else if(ev.kind==TRACE_RX) {
+			if(waiting) {
+				// Answer arrived: request on the wire, target busy, answer on the wire
+				uint64_t wires=wire(sent_bytes,baud)+wire(ev.size,baud);
+				if(ev.time-sent>wires) seg.device+=ev.time-sent-wires;
+				waiting=false;
+			}
+			seg.rx+=ev.size;
+			seg.link+=wire(ev.size,baud);
+		}
+		seg.end=ev.time;
+	}
+	if(seg.tx||seg.rx) segment_out(&seg,number,&total);
+	host=total.end>total.link+total.device?total.end-total.link-total.device:0;
+	printf("Total       %-6u %-6u %9.1f %9.1f %9.1f %9.1f\n",total.tx,total.rx,total.end/1000.0,total.link/1000.0,total.device/1000.0,host/1000.0);
+}
+
+// Recorded answer being compared during replay
+uint8_t expect[0x1000];
+size_t expected=0;
+
+// Compare answer of target with recorded one, discard anything beyond it
+// Returns true if they match
+bool compare(transport_t *port,uint8_t id) {
+	uint8_t got[sizeof(expect)];
+	size_t n=0,extra;
+	bool match;
+	if(expected) {
+		twait(port,expected,tdeadline(1000));
+		n=tread(port,got,expected,tnow());
+	}
+	extra=twait(port,1,tnow());
+	match=n==expected&&!extra&&memcmp(got,expect,n)==0;
+	// Before the first command, how much wake carrier gets answered is down to timing
+	if(!match&&id) {
+		if(n!=expected||extra) {
+			printf("Command %c: %u bytes answered, %u recorded\n",id,(unsigned)(n+extra),(unsigned)expected);
+		} else {
+			for(n=0;got[n]==expect[n];n++);
+			printf("Command %c: answer differs from byte %u\n",id,(unsigned)n);
+		}
+	}
+	tflush(port);
+	expected=0;
+	return match||!id;
+}
+
+bool replay(trace_t *trace,char *device,bool fast) {
+	trace_event_t ev;
+	transport_t *port;
+	uint64_t start,now;
+	uint8_t id=0;
+	uint32_t commands=0,differ=0,baud;
+	uint64_t recorded=0;
+	if(!(port=topen(device))) {
+		printf("Unable to open %s\n",device);
+		return false;
+	}
+	start=tmicros();
+	while(trace_next(trace,&ev)) {
+		if(!fast) {
+			// Keep recorded timing, sleep for the coarse part
+			while((now=tmicros()-start)<ev.time) {
+				if(ev.time-now>2000) Sleep(1);
+			}
+		}
+		if(ev.kind==TRACE_RX) {
+			if(expected+ev.size<=sizeof(expect)) {
+				memcpy(&expect[expected],ev.data,ev.size);
+				expected+=ev.size;
+			}
+		} else {
+			if(!compare(port,id)) differ++;
+			if(ev.kind==TRACE_MARK) {
+				id=ev.data[0];
+				commands++;
+			} else if(ev.kind==TRACE_CONFIG) {
+				baud=ev.data[0]|(ev.data[1]<<8)|(ev.data[2]<<16)|(ev.data[3]<<24);
+				tconfig(port,baud);
+			} else if(ev.kind==TRACE_TX) {
+				twrite(port,ev.data,ev.size,tdeadline(1000));
+			}
+		}
+		recorded=ev.time;
+	}
+	// Recording may stop before the last answer came in, nothing to compare then
+	if(expected&&!compare(port,id)) differ++;
+	printf("%u commands replayed in %.1f ms (recorded %.1f ms), %u answers differ\n",
+	       commands,(tmicros()-start)/1000.0,recorded/1000.0,differ);
+	tclose(port);
+	return differ==0;
+}
+
+int main(int argc,char**argv) {
+	char *device="loop";
+	bool fast=false;
+	trace_t *trace;
+	bool ok;
+	int n;
+	if(argc<3) {
+		help_out();
+		exit(1);
+	}
+	for(n=3;n<argc;n++) {
+		if(strcmp("-o",argv[n])==0&&n+1<argc) {
+			device=argv[++n];
+		} else if(strcmp("--fast",argv[n])==0) {
+			fast=true;
+		} else {
+			printf("Unknown option %s\n",argv[n]);
+			help_out();
+			exit(1);
+		}
+	}
+	if(!(trace=trace_open(argv[2]))) {
+		printf("Unable to read trace file %s\n",argv[2]);
+		exit(1);
+	}
+	if(strcmp("analyze",argv[1])==0) {
+		analyze(trace);
+		ok=true;
+	} else if(strcmp("replay",argv[1])==0) {
+		ok=replay(trace,device,fast);
+	} else {
+		help_out();
+		ok=false;
+	}
+	trace_close(trace);
+	exit(ok?0:1);
+}
@@ -0,0 +1,120 @@
+// Station daemon stand-in, serves simulated bootloaders on a local socket
+//
+// Speaks the daemon side of the protocol in transport.c, with a fresh
+// simdev behind every connection in place of an optical head, so the
+// unix: transport can be run without a station:
+//   optstation station.sock
+//   optic firmware.hex -o unix:station.sock@head1
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <winsock2.h>
+#include <afunix.h>
+#include <windows.h>
+#include "simdev.h"
+
+// Answer of target, collected while a message is fed to it
+typedef struct {
+	SOCKET s;
+	uint8_t data[0x400];
+	uint16_t size;
+	bool failed;
+} reply_t;
+
+static void reply_flush(reply_t *reply) {
+	uint16_t done=0;
+	int n;
+	while(done<reply->size&&!reply->failed) {
+		n=send(reply->s,(char*)&reply->data[done],reply->size-done,0);
+		if(n<=0) reply->failed=true;
+		else     done+=n;
+	}
+	reply->size=0;
+}
+
+static void reply_tx(void *ctx,uint8_t data) {
+	reply_t *reply=ctx;
+	if(reply->size==sizeof(reply->data)) reply_flush(reply);
+	reply->data[reply->size++]=data;
+}
+
+// Receive exactly i_recv bytes, false if connection closed
+static bool recv_all(SOCKET s,void *p_recv,uint16_t i_recv) {
+	char *p_data=p_recv;
+	int n;
+	while(i_recv) {
+		n=recv(s,p_data,i_recv,0);
+		if(n<=0) return false;
+		p_data+=n;
+		i_recv-=n;
+	}
+	return true;
+}
+
+// Handle one connection until host closes it
+static void serve(SOCKET s) {
+	static uint8_t data[0x10000];
+	static simdev_t dev;
+	static reply_t reply;
+	uint8_t header[3];
+	uint16_t size,n;
+	reply.s=s;
+	reply.size=0;
+	reply.failed=false;
+	simdev_init(&dev,reply_tx,&reply);
+	while(!reply.failed&&recv_all(s,header,sizeof(header))) {
+		size=header[1]|(header[2]<<8);
+		if(!recv_all(s,data,size)) break;
+		if(header[0]=='O') {
+			printf("Head '%.*s' selected\n",size,data);
+		} else if(header[0]=='C') {
+			printf("Head configured to %.*s\n",size,data);
+		} else if(header[0]=='D') {
+			// Message is one burst on the line, target sees it go idle after
+			for(n=0;n<size;n++) simdev_rx(&dev,data[n]);
+			simdev_idle(&dev);
+			reply_flush(&reply);
+		} else {
+			printf("Unknown message type %02X\n",header[0]);
+			break;
+		}
+	}
+	printf("Host disconnected\n");
+}
+
+int main(int argc,char**argv) {
+	struct sockaddr_un addr;
+	WSADATA wsa;
+	SOCKET listener,s;
+	if(argc!=2) {
+		printf("Useage: optstation socket\n");
+		exit(1);
+	}
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	strncpy(addr.sun_path,argv[1],sizeof(addr.sun_path)-1);
+	if(WSAStartup(MAKEWORD(2,2),&wsa)) {
+		printf("Unable to start winsock\n");
+		exit(1);
+	}
+	// Socket file is left behind by the previous run
+	remove(addr.sun_path);
+	listener=socket(AF_UNIX,SOCK_STREAM,0);
+	if(listener==INVALID_SOCKET||bind(listener,(struct sockaddr*)&addr,sizeof(addr))||listen(listener,1)) {
+		printf("Unable to listen on %s\n",argv[1]);
+		WSACleanup();
+		exit(1);
+	}
+	printf("Serving simulated bootloader on %s\n",argv[1]);
+	while((s=accept(listener,NULL,NULL))!=INVALID_SOCKET) {
+		printf("Host connected\n");
+		serve(s);
+		closesocket(s);
+	}
+	closesocket(listener);
+	WSACleanup();
+	exit(0);
+}
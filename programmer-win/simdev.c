@@ -0,0 +1,251 @@
+// Source file for simulated bootloader
+//
+// Mirrors command handling of bootloader.c, see there for details
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "simdev.h"
+
+#define ACK 0x06
+#define NAK 0x15
+#define SYNC 0xA5
+#define MARKER 0xFF
+#define EEPROM_BLOCK 16
+#define LINK_TEST 16
+
+// Battery readout as sampled at 3V (FVR 1.024V, left justified)
+#define BATTERY 0x5740
+
+// CRC-8, polynomial 0x07
+static uint8_t crc8(uint8_t crc,uint8_t data) {
+	int n;
+	crc^=data;
+	for(n=0;n<8;n++) crc=(crc&0x80)?(crc<<1)^0x07:(crc<<1);
+	return crc;
+}
+
+static void tx(simdev_t *dev,uint8_t data) {
+	dev->tx_crc=crc8(dev->tx_crc,data);
+	dev->tx(dev->ctx,data);
+}
+
+// Read page into command buffer, returns checksum over page and data
+// Pages beyond the end of flash wrap around
+static uint8_t row_read(simdev_t *dev,uint8_t page) {
+	uint16_t addr=(page&0x7F)<<5;
+	uint8_t csum=page;
+	int n;
+	for(n=0;n<0x20;n++) {
+		dev->command[(n<<1)+2]=dev->flash[addr+n]>>8;
+		dev->command[(n<<1)+3]=dev->flash[addr+n]&0xFF;
+		csum+=dev->command[(n<<1)+2]+dev->command[(n<<1)+3];
+	}
+	return csum;
+}
+
+// Write page from command buffer, bootloader pages are refused
+static void row_write(simdev_t *dev,uint8_t page) {
+	int n;
+	dev->eeprom[MARKER]=0x00;
+	if(page<0x10) return;
+	for(n=0;n<0x20;n++) {
+		dev->flash[((page&0x7F)<<5)+n]=((dev->command[(n<<1)+2]<<8)|dev->command[(n<<1)+3])&0x3FFF;
+	}
+}
+
+static uint8_t command_length(uint8_t id) {
+	switch(id) {
+		case 'W': return 67;
+		case 'R': return 2;
+		case 'F': return 5;
+		case 'C': return 4;
+		case 'Q': return 3;
+		case 'E': return EEPROM_BLOCK+4;
+		case 'D': return 3;
+		case 'B': return 1;
+		case 'X': return 1;
+		case 'S': return 3;
+		case 'I': return 1;
+		case 'P': return 1;
+		case 'L': return 3;
+		case 'T': return LINK_TEST+1;
+	}
+	return 0;
+}
+
+static void execute(simdev_t *dev) {
+	uint8_t *command=dev->command;
+	uint8_t csum=0;
+	int n;
+	switch(command[0]) {
+		case 'W':
+			for(n=1;n<66;n++) csum+=command[n];
+			if(csum!=command[n]) {
+				tx(dev,NAK);
+				tx(dev,csum);
+			} else {
+				row_write(dev,command[1]);
+				tx(dev,ACK);
+			}
+			break;
+		case 'R':
+			tx(dev,ACK);
+			csum=row_read(dev,command[1]);
+			for(n=2;n<66;n++) tx(dev,command[n]);
+			tx(dev,csum);
+			break;
+		case 'F':
+		case 'C':
+			csum=command[1]+command[2];
+			n=3;
+			if(command[0]=='F') csum+=command[n++];
+			if(csum!=command[n]) {
+				tx(dev,NAK);
+				tx(dev,csum);
+			} else {
+				if(command[0]=='F') {
+					for(n=4;n<66;n++) command[n]=command[n-2];
+				} else {
+					row_read(dev,command[2]);
+				}
+				row_write(dev,command[1]);
+				tx(dev,ACK);
+				tx(dev,row_read(dev,command[1]));
+			}
+			break;
+		case 'Q':
+			tx(dev,ACK);
+			for(n=command[2];n;n--) tx(dev,row_read(dev,command[1]++));
+			break;
+		case 'E':
+			for(n=1;n<EEPROM_BLOCK+3;n++) csum+=command[n];
+			if(csum!=command[n]||command[2]>EEPROM_BLOCK||command[1]+command[2]>MARKER) {
+				tx(dev,NAK);
+				tx(dev,csum);
+			} else {
+				for(n=0;n<command[2];n++) dev->eeprom[command[1]+n]=command[n+3];
+				tx(dev,ACK);
+			}
+			break;
+		case 'D':
+			tx(dev,ACK);
+			csum=command[1];
+			for(n=0;n<command[2];n++) {
+				tx(dev,dev->eeprom[(uint8_t)(command[1]+n)]);
+				csum+=dev->eeprom[(uint8_t)(command[1]+n)];
+			}
+			tx(dev,csum);
+			break;
+		case 'B':
+			tx(dev,ACK);
+			tx(dev,BATTERY>>8);
+			tx(dev,BATTERY&0xFF);
+			break;
+		case 'X':
+			tx(dev,ACK);
+			dev->eeprom[MARKER]=0xFF;
+			dev->running=true;
+			break;
+		case 'L':
+			// 16MHz profile only keeps up with 9600, new baudrate is not modelled
+			tx(dev,command[1]<1?ACK:NAK);
+			break;
+		case 'T':
+			tx(dev,ACK);
+			for(n=1;n<LINK_TEST+1;n++) tx(dev,command[n]);
+			tx(dev,0x00);
+			tx(dev,0x00);
+			break;
+		case 'I':
+			tx(dev,ACK);
+			tx(dev,SIMDEV_PROTOCOL);
+			break;
+		case 'P':
+			// Full build: bootloader ends at page 0x10, all optional commands
+			tx(dev,ACK);
+			tx(dev,0x200>>5);
+			tx(dev,0x1F);
+			break;
+		case 'S':
+			tx(dev,ACK);
+			tx(dev,ACK);
+			break;
+		default:
+			tx(dev,NAK);
+	}
+}
+
+static bool frame_valid(simdev_t *dev) {
+	uint8_t crc;
+	int n;
+	crc=crc8(crc8(0,dev->command[0]),dev->frame_length);
+	for(n=1;n<dev->frame_length+2;n++) crc=crc8(crc,dev->command[n]);
+	return !crc&&command_length(dev->command[0])==dev->frame_length+1;
+}
+
+static void execute_frame(simdev_t *dev,bool valid) {
+	tx(dev,SYNC);
+	dev->tx_crc=0;
+	if(valid) execute(dev);
+	else      tx(dev,NAK);
+	tx(dev,dev->tx_crc);
+}
+
+void simdev_init(simdev_t *dev,void (*tx)(void *ctx,uint8_t data),void *ctx) {
+	int n;
+	memset(dev,0,sizeof(simdev_t));
+	for(n=0;n<0x1000;n++) dev->flash[n]=0x3FFF;
+	memset(dev->eeprom,0xFF,sizeof(dev->eeprom));
+	dev->tx=tx;
+	dev->ctx=ctx;
+}
+
+// Same state machine as main() in bootloader.c, one received byte at a time
+void simdev_rx(simdev_t *dev,uint8_t data) {
+	bool ready=false;
+	if(dev->running||dev->discard) return;
+	if(dev->length) {
+		dev->command[dev->index++]=data;
+		if(!--dev->length) {
+			if(dev->frame==1) {
+				dev->frame=2;
+				dev->frame_length=dev->command[1];
+				if(dev->frame_length<=sizeof(dev->command)-2) {
+					dev->length=dev->frame_length+1;
+					dev->index=1;
+				} else {
+					dev->discard=true;
+				}
+			} else {
+				ready=true;
+			}
+		}
+	} else if(data==SYNC) {
+		dev->frame=1;
+		dev->index=0;
+		dev->length=2;
+	} else {
+		dev->frame=0;
+		dev->command[0]=data;
+		dev->index=1;
+		dev->length=command_length(data);
+		tx(dev,dev->length);
+		if(dev->length) if(!--dev->length) ready=true;
+	}
+	if(ready&&dev->frame&&!frame_valid(dev)) {
+		ready=false;
+		dev->discard=true;
+	}
+	if(ready) {
+		if(dev->frame) execute_frame(dev,true);
+		else           execute(dev);
+	}
+}
+
+// Damaged frame is answered once the rest of the burst has passed
+void simdev_idle(simdev_t *dev) {
+	if(!dev->discard) return;
+	dev->discard=false;
+	execute_frame(dev,false);
+}
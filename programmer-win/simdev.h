@@ -0,0 +1,40 @@
+// Header for simulated bootloader
+//
+// Speaks the protocol of bootloader.c byte for byte, with flash and data
+// EEPROM in memory, so the download engine can run without a target.
+// Bytes sent by the host go to simdev_rx, responses come out through tx.
+
+#ifndef SIMDEV_H
+#define SIMDEV_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Protocol version reported by I command
+#define SIMDEV_PROTOCOL 5
+
+typedef struct {
+	uint16_t flash[0x1000];  // program words, 0x000-0x1FF belong to bootloader
+	uint8_t eeprom[0x100];   // data EEPROM, 0xFF is image-valid marker
+	uint8_t command[68];     // command buffer, as on target
+	uint8_t length;          // bytes still expected
+	uint8_t index;           // next command buffer position
+	uint8_t frame;           // 0 = v1, 1 = v2 header, 2 = v2 payload
+	uint8_t frame_length;    // v2 payload length
+	uint8_t tx_crc;          // CRC of transmitted bytes, for v2 responses
+	bool discard;            // damaged v2 frame, ignore bytes until line is idle
+	bool running;            // X received, firmware runs and ignores us
+	void (*tx)(void *ctx,uint8_t data);
+	void *ctx;
+} simdev_t;
+
+// reset to blank device with valid (empty) image
+void simdev_init(simdev_t *dev,void (*tx)(void *ctx,uint8_t data),void *ctx);
+
+// feed one byte received by device
+void simdev_rx(simdev_t *dev,uint8_t data);
+
+// line went idle, end of a burst from host
+void simdev_idle(simdev_t *dev);
+
+#endif
@@ -0,0 +1,92 @@
+// Source file for link trace files, see trace.h for format
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+#include "transport.h"
+
+static const char magic[4]={'O','P','T','R'};
+
+trace_t *trace_create(char *filename) {
+	trace_t *trace=malloc(sizeof(trace_t));
+	if(!trace) return NULL;
+	if(!(trace->f=fopen(filename,"wb"))) {
+		free(trace);
+		return NULL;
+	}
+	fwrite(magic,1,sizeof(magic),trace->f);
+	fputc(TRACE_VERSION,trace->f);
+	trace->last=tmicros();
+	return trace;
+}
+
+void trace_event(trace_t *trace,uint8_t kind,void *p_data,uint16_t i_data) {
+	trace_event_at(trace,tmicros(),kind,p_data,i_data);
+}
+
+void trace_event_at(trace_t *trace,uint64_t time,uint8_t kind,void *p_data,uint16_t i_data) {
+	uint8_t *p=p_data;
+	uint64_t delta;
+	uint8_t size;
+	// Events are stored in order, keep time from running backwards
+	if(time<trace->last) time=trace->last;
+	delta=time-trace->last;
+	trace->last=time;
+	do {
+		// Time delta, 7 bits at a time
+		while(delta>0x7F) {
+			fputc((delta&0x7F)|0x80,trace->f);
+			delta>>=7;
+		}
+		fputc(delta,trace->f);
+		size=i_data>TRACE_DATA?TRACE_DATA:i_data;
+		fputc((kind<<6)|size,trace->f);
+		fwrite(p,1,size,trace->f);
+		p+=size;
+		i_data-=size;
+		delta=0;
+	} while(i_data);
+}
+
+trace_t *trace_open(char *filename) {
+	char head[sizeof(magic)+1];
+	trace_t *trace=malloc(sizeof(trace_t));
+	if(!trace) return NULL;
+	if(!(trace->f=fopen(filename,"rb"))) {
+		free(trace);
+		return NULL;
+	}
+	if(fread(head,1,sizeof(head),trace->f)!=sizeof(head)||memcmp(head,magic,sizeof(magic))||head[4]!=TRACE_VERSION) {
+		fclose(trace->f);
+		free(trace);
+		return NULL;
+	}
+	trace->last=0;
+	return trace;
+}
+
+bool trace_next(trace_t *trace,trace_event_t *event) {
+	uint64_t delta=0;
+	int shift=0;
+	int c;
+	do {
+		if((c=fgetc(trace->f))==EOF) return false;
+		delta|=(uint64_t)(c&0x7F)<<shift;
+		shift+=7;
+	} while(c&0x80);
+	if((c=fgetc(trace->f))==EOF) return false;
+	event->kind=c>>6;
+	event->size=c&TRACE_DATA;
+	if(fread(event->data,1,event->size,trace->f)!=event->size) return false;
+	trace->last+=delta;
+	event->time=trace->last;
+	return true;
+}
+
+void trace_close(trace_t *trace) {
+	fclose(trace->f);
+	free(trace);
+}
@@ -0,0 +1,59 @@
+// Header for link trace files
+//
+// Compact binary record of everything a transport sent and received:
+//   magic "OPTR", version byte, then events of
+//   time since previous event in microseconds (LEB128 varint),
+//   kind (bits 7-6) and data length 0-63 (bits 5-0), data
+//
+// Received data is stamped when the host picked it up, so it includes
+// the host receive latency. Sent data is stamped when the write started,
+// as serial writes only return once the bytes are on the wire.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define TRACE_VERSION 1
+
+// Event kinds
+#define TRACE_TX     0 // bytes sent to target
+#define TRACE_RX     1 // bytes received from target
+#define TRACE_MARK   2 // command started, data is command identifier
+#define TRACE_CONFIG 3 // baudrate, 32 bit little endian
+
+#define TRACE_DATA 63 // max data per event, longer data is split
+
+typedef struct trace_s {
+	FILE *f;
+	uint64_t last; // time of previous event, us
+} trace_t;
+
+typedef struct {
+	uint8_t kind;
+	uint64_t time; // us since trace was created
+	uint8_t size;
+	uint8_t data[TRACE_DATA];
+} trace_event_t;
+
+// create trace file, NULL if unsuccessful
+trace_t *trace_create(char *filename);
+
+// record event, stamped now
+void trace_event(trace_t *trace,uint8_t kind,void *p_data,uint16_t i_data);
+
+// record event that happened at time, tmicros
+void trace_event_at(trace_t *trace,uint64_t time,uint8_t kind,void *p_data,uint16_t i_data);
+
+// open trace file for reading, NULL if not a trace
+trace_t *trace_open(char *filename);
+
+// read next event, false at end of trace
+bool trace_next(trace_t *trace,trace_event_t *event);
+
+// close trace file
+void trace_close(trace_t *trace);
+
+#endif
@@ -0,0 +1,369 @@
+// Source file for byte stream transports to a bootloader
+//
+// Implementations: serial port (serial.c), in-process loopback to simdev.c,
+// and local socket bridge to a station daemon
+//
+// Station daemon protocol, host to daemon messages are type, 16 bit length
+// (little endian) and payload:
+//   'O' head name   select optical head, sent once after connecting
+//   'C' fmt         configure head, fmt as for sconfig
+//   'D' data        bytes to send to target
+// Daemon to host is the plain byte stream received from target.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <winsock2.h>
+#include <afunix.h>
+#include <windows.h>
+#include "transport.h"
+#include "serial.h"
+#include "simdev.h"
+#include "trace.h"
+
+// Ring buffer
+
+uint16_t ring_count(ring_t *ring) {
+	return ring->head-ring->tail;
+}
+
+uint16_t ring_space(ring_t *ring,uint8_t **p_space) {
+	uint32_t offset=ring->head&(RING_SIZE-1);
+	uint32_t space=RING_SIZE-(ring->head-ring->tail);
+	if(space>RING_SIZE-offset) space=RING_SIZE-offset;
+	*p_space=&ring->data[offset];
+	return space;
+}
+
+void ring_commit(ring_t *ring,uint16_t i_commit) {
+	ring->head+=i_commit;
+}
+
+uint16_t ring_span(ring_t *ring,uint8_t **p_span) {
+	uint32_t offset=ring->tail&(RING_SIZE-1);
+	uint32_t span=ring->head-ring->tail;
+	if(span>RING_SIZE-offset) span=RING_SIZE-offset;
+	*p_span=&ring->data[offset];
+	return span;
+}
+
+void ring_consume(ring_t *ring,uint16_t i_consume) {
+	ring->tail+=i_consume;
+}
+
+// Serial port, one per process as serial.c keeps a single handle
+
+static bool serial_open(transport_t *t,char *device) {
+	return sopen(device);
+}
+
+static bool serial_config(transport_t *t,char *fmt) {
+	return sconfig(fmt);
+}
+
+static int32_t serial_write(transport_t *t,void *p_write,uint16_t i_write) {
+	return swrite(p_write,i_write);
+}
+
+static int32_t serial_fill(transport_t *t,uint32_t deadline) {
+	uint8_t *p_space;
+	int32_t avail,got=0,n;
+	uint16_t space;
+	while(!(avail=speek())&&(int32_t)(deadline-tnow())>0) Sleep(1);
+	while(avail>0) {
+		space=ring_space(&t->rx,&p_space);
+		if(!space) break;
+		if(space>avail) space=avail;
+		n=sread(p_space,space);
+		if(n<0) return -1;
+		if(n==0) break;
+		ring_commit(&t->rx,n);
+		avail-=n;
+		got+=n;
+	}
+	return got;
+}
+
+static void serial_close(transport_t *t) {
+	sclose();
+}
+
+static const transport_ops_t serial_ops={
+	NULL,serial_open,serial_config,serial_write,serial_fill,serial_close
+};
+
+// In-process loopback, simulated bootloader answers while data is written
+
+static void loop_tx(void *ctx,uint8_t data) {
+	transport_t *t=ctx;
+	uint8_t *p_space;
+	if(ring_space(&t->rx,&p_space)) {
+		*p_space=data;
+		ring_commit(&t->rx,1);
+	}
+}
+
+static bool loop_open(transport_t *t,char *device) {
+	simdev_t *dev=malloc(sizeof(simdev_t));
+	if(!dev) return false;
+	simdev_init(dev,loop_tx,t);
+	t->ctx=dev;
+	return true;
+}
+
+static bool loop_config(transport_t *t,char *fmt) {
+	return true;
+}
+
+static int32_t loop_write(transport_t *t,void *p_write,uint16_t i_write) {
+	uint8_t *p_data=p_write;
+	uint16_t n;
+	for(n=0;n<i_write;n++) simdev_rx(t->ctx,p_data[n]);
+	simdev_idle(t->ctx);
+	return i_write;
+}
+
+static int32_t loop_fill(transport_t *t,uint32_t deadline) {
+	// Answers are already in the ring, nothing more will come by waiting
+	if((int32_t)(deadline-tnow())>0) Sleep(1);
+	return 0;
+}
+
+static void loop_close(transport_t *t) {
+	free(t->ctx);
+}
+
+static const transport_ops_t loop_ops={
+	"loop",loop_open,loop_config,loop_write,loop_fill,loop_close
+};
+
+// Local socket bridge to station daemon, device is "unix:path[@head]"
+
+static bool bridge_send(transport_t *t,char type,void *p_send,uint16_t i_send) {
+	SOCKET s=(SOCKET)(intptr_t)t->ctx;
+	uint8_t header[3]={type,i_send&0xFF,i_send>>8};
+	char *p_data=p_send;
+	int n;
+	if(send(s,(char*)header,sizeof(header),0)!=sizeof(header)) return false;
+	while(i_send) {
+		n=send(s,p_data,i_send,0);
+		if(n<=0) return false;
+		p_data+=n;
+		i_send-=n;
+	}
+	return true;
+}
+
+static bool bridge_open(transport_t *t,char *device) {
+	struct sockaddr_un addr;
+	WSADATA wsa;
+	SOCKET s;
+	char *head;
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	strncpy(addr.sun_path,&device[5],sizeof(addr.sun_path)-1);
+	head=strchr(addr.sun_path,'@');
+	if(head) *head++=0;
+	if(WSAStartup(MAKEWORD(2,2),&wsa)) return false;
+	s=socket(AF_UNIX,SOCK_STREAM,0);
+	if(s==INVALID_SOCKET) {
+		WSACleanup();
+		return false;
+	}
+	if(connect(s,(struct sockaddr*)&addr,sizeof(addr))) {
+		closesocket(s);
+		WSACleanup();
+		return false;
+	}
+	t->ctx=(void*)(intptr_t)s;
+	if(!head) head="";
+	if(!bridge_send(t,'O',head,strlen(head))) {
+		closesocket(s);
+		WSACleanup();
+		return false;
+	}
+	return true;
+}
+
+static bool bridge_config(transport_t *t,char *fmt) {
+	return bridge_send(t,'C',fmt,strlen(fmt));
+}
+
+static int32_t bridge_write(transport_t *t,void *p_write,uint16_t i_write) {
+	return bridge_send(t,'D',p_write,i_write)?i_write:-1;
+}
+
+static int32_t bridge_fill(transport_t *t,uint32_t deadline) {
+	SOCKET s=(SOCKET)(intptr_t)t->ctx;
+	int32_t wait=deadline-tnow();
+	struct timeval tv;
+	fd_set fds;
+	uint8_t *p_space;
+	uint16_t space;
+	int n;
+	if(wait<0) wait=0;
+	tv.tv_sec=wait/1000;
+	tv.tv_usec=(wait%1000)*1000;
+	FD_ZERO(&fds);
+	FD_SET(s,&fds);
+	n=select(s+1,&fds,NULL,NULL,&tv);
+	if(n<0) return -1;
+	if(n==0) return 0;
+	space=ring_space(&t->rx,&p_space);
+	if(!space) return 0;
+	n=recv(s,(char*)p_space,space,0);
+	if(n<=0) return -1;
+	ring_commit(&t->rx,n);
+	return n;
+}
+
+static void bridge_close(transport_t *t) {
+	closesocket((SOCKET)(intptr_t)t->ctx);
+	WSACleanup();
+}
+
+static const transport_ops_t bridge_ops={
+	"unix:",bridge_open,bridge_config,bridge_write,bridge_fill,bridge_close
+};
+
+// Implementations by device name prefix, last one matches anything
+static const transport_ops_t *transports[]={&loop_ops,&bridge_ops,&serial_ops};
+
+// Transport API
+
+uint32_t tnow(void) {
+	return GetTickCount();
+}
+
+uint32_t tdeadline(uint32_t ms) {
+	return GetTickCount()+ms;
+}
+
+uint64_t tmicros(void) {
+	LARGE_INTEGER count,freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	// Split to keep count * 1000000 from overflowing
+	return (uint64_t)(count.QuadPart/freq.QuadPart)*1000000+(uint64_t)(count.QuadPart%freq.QuadPart)*1000000/freq.QuadPart;
+}
+
+// Record data that arrived in ring since last time
+static void trace_rx(transport_t *t) {
+	uint32_t offset,span;
+	if(!t->trace) return;
+	while(t->traced!=t->rx.head) {
+		offset=t->traced&(RING_SIZE-1);
+		span=t->rx.head-t->traced;
+		if(span>RING_SIZE-offset) span=RING_SIZE-offset;
+		trace_event(t->trace,TRACE_RX,&t->rx.data[offset],span);
+		t->traced+=span;
+	}
+}
+
+// Receive through implementation, recording what arrived
+static int32_t fill(transport_t *t,uint32_t deadline) {
+	int32_t got=t->ops->fill(t,deadline);
+	trace_rx(t);
+	return got;
+}
+
+transport_t *topen(char *device) {
+	transport_t *t;
+	int n;
+	t=malloc(sizeof(transport_t));
+	if(!t) return NULL;
+	memset(t,0,sizeof(transport_t));
+	for(n=0;n<sizeof(transports)/sizeof(*transports);n++) {
+		t->ops=transports[n];
+		if(!t->ops->prefix||strncmp(device,t->ops->prefix,strlen(t->ops->prefix))==0) break;
+	}
+	if(!t->ops->open(t,device)) {
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+bool tconfig(transport_t *t,uint32_t baud) {
+	char fmt[32];
+	uint8_t le[4]={baud,baud>>8,baud>>16,baud>>24};
+	if(t->trace) trace_event(t->trace,TRACE_CONFIG,le,sizeof(le));
+	sprintf(fmt,"%u,N,8,1",baud);
+	return t->ops->config(t,fmt);
+}
+
+int32_t twrite(transport_t *t,void *p_write,uint16_t i_write,uint32_t deadline) {
+	uint8_t *p_data=p_write;
+	int32_t done=0,n;
+	uint64_t start;
+	while(done<i_write) {
+		start=tmicros();
+		n=t->ops->write(t,&p_data[done],i_write-done);
+		if(n<0) break;
+		if(t->trace&&n) {
+			trace_event_at(t->trace,start,TRACE_TX,&p_data[done],n);
+			// Loopback answers while being written to
+			trace_rx(t);
+		}
+		done+=n;
+		if((int32_t)(deadline-tnow())<=0) break;
+	}
+	return done;
+}
+
+uint16_t twait(transport_t *t,uint16_t i_wait,uint32_t deadline) {
+	while(ring_count(&t->rx)<i_wait) {
+		if(fill(t,deadline)<0) break;
+		if((int32_t)(deadline-tnow())<=0) {
+			// Pick up what arrived meanwhile
+			fill(t,deadline);
+			break;
+		}
+	}
+	return ring_count(&t->rx);
+}
+
+uint16_t tread(transport_t *t,void *p_read,uint16_t i_read,uint32_t deadline) {
+	uint8_t *p_data=p_read;
+	uint8_t *p_span;
+	uint16_t done=0,span;
+	twait(t,1,deadline);
+	while(done<i_read&&(span=ring_span(&t->rx,&p_span))) {
+		if(span>i_read-done) span=i_read-done;
+		memcpy(&p_data[done],p_span,span);
+		ring_consume(&t->rx,span);
+		done+=span;
+	}
+	return done;
+}
+
+uint16_t tspan(transport_t *t,uint8_t **p_span) {
+	return ring_span(&t->rx,p_span);
+}
+
+void tconsume(transport_t *t,uint16_t i_consume) {
+	ring_consume(&t->rx,i_consume);
+}
+
+void tflush(transport_t *t) {
+	do {
+		ring_consume(&t->rx,ring_count(&t->rx));
+	} while(fill(t,tnow())>0);
+}
+
+bool ttrace(transport_t *t,char *filename) {
+	t->traced=t->rx.head;
+	return (t->trace=trace_create(filename))!=NULL;
+}
+
+void tmark(transport_t *t,uint8_t id) {
+	if(t->trace) trace_event(t->trace,TRACE_MARK,&id,1);
+}
+
+void tclose(transport_t *t) {
+	t->ops->close(t);
+	if(t->trace) trace_close(t->trace);
+	free(t);
+}
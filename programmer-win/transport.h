@@ -0,0 +1,107 @@
+// Header for byte stream transports to a bootloader
+//
+// A transport is opened by device name:
+//   COMn               serial port with optical head
+//   loop               in-process simulated bootloader, see simdev.h
+//   unix:path[@head]   station daemon listening on a local socket
+//
+// Received data is moved straight into the ring buffer of the transport
+// and can be inspected there with tspan/tconsume, without copying.
+// Timeouts are absolute deadlines in milliseconds, see tdeadline.
+// Traffic can be recorded to a trace file, see trace.h.
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Receive ring buffer, size must be a power of two
+#define RING_SIZE 0x1000
+
+typedef struct {
+	uint8_t data[RING_SIZE];
+	uint32_t head; // total bytes written
+	uint32_t tail; // total bytes consumed
+} ring_t;
+
+// bytes buffered
+uint16_t ring_count(ring_t *ring);
+
+// contiguous free space at head, commit what was written to it
+uint16_t ring_space(ring_t *ring,uint8_t **p_space);
+void ring_commit(ring_t *ring,uint16_t i_commit);
+
+// contiguous data at tail, consume what was used of it
+uint16_t ring_span(ring_t *ring,uint8_t **p_span);
+void ring_consume(ring_t *ring,uint16_t i_consume);
+
+typedef struct transport_s transport_t;
+
+// Transport implementation
+typedef struct {
+	// device name prefix that selects implementation
+	char *prefix;
+	// open device, returns true if successful
+	bool (*open)(transport_t *t,char *device);
+	// configure, fmt has form "baud,parity,databits,stopbit", ie: "9600,N,8,1"
+	bool (*config)(transport_t *t,char *fmt);
+	// write, returns bytes actually written or -1
+	int32_t (*write)(transport_t *t,void *p_write,uint16_t i_write);
+	// move received data into ring, waiting for some until deadline
+	// returns bytes received or -1
+	int32_t (*fill)(transport_t *t,uint32_t deadline);
+	// close device
+	void (*close)(transport_t *t);
+} transport_ops_t;
+
+struct transport_s {
+	const transport_ops_t *ops;
+	ring_t rx;
+	void *ctx;
+	struct trace_s *trace; // traffic record, NULL = off
+	uint32_t traced;       // received data recorded up to this ring position
+};
+
+// current time and deadline ms from now
+uint32_t tnow(void);
+uint32_t tdeadline(uint32_t ms);
+
+// high resolution time, us
+uint64_t tmicros(void);
+
+// open transport selected by device name, NULL if unsuccessful
+transport_t *topen(char *device);
+
+// configure baudrate (8N1)
+bool tconfig(transport_t *t,uint32_t baud);
+
+// write all data unless deadline passes
+// returns bytes actually written
+int32_t twrite(transport_t *t,void *p_write,uint16_t i_write,uint32_t deadline);
+
+// wait until i_wait bytes are buffered or deadline passes
+// returns bytes buffered
+uint16_t twait(transport_t *t,uint16_t i_wait,uint32_t deadline);
+
+// read what is buffered, waiting for at least one byte until deadline
+// returns bytes actually read
+uint16_t tread(transport_t *t,void *p_read,uint16_t i_read,uint32_t deadline);
+
+// contiguous buffered data, consume what was used of it
+uint16_t tspan(transport_t *t,uint8_t **p_span);
+void tconsume(transport_t *t,uint16_t i_consume);
+
+// discard buffered and pending data
+void tflush(transport_t *t);
+
+// record traffic to trace file, returns true if successful
+bool ttrace(transport_t *t,char *filename);
+
+// note start of command in trace
+void tmark(transport_t *t,uint8_t id);
+
+// close transport, and trace if any
+void tclose(transport_t *t);
+
+#endif